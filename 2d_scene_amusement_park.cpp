@@ -5,7 +5,29 @@
 #include <cmath>
 #include <cstdlib>
 #include <ctime>
-#include <utility> /
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <tuple>
+#include <climits>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <cstdio>
+#include <sys/stat.h>
+#include "frame_writer.h"
+#include "shm_frame_sink.h"
+#include "trace_events.h"
+#include "perf_counters.h"
+#include "scene_file.h"
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define PARK_X86_SIMD 1
+#endif
 using namespace std;
 
 
@@ -27,13 +49,6 @@ bool isNight = false;
 // Roller coaster
 float cartT = 0.0f; // parametric position along track
 
-// Fireworks
-struct Firework {
-    float x, y, radius;
-    float r, g, b, alpha;
-    bool active;
-};
-vector<Firework> fireworks;
 vector<pair<int, int>> starPositions;
 
 // Waving flags
@@ -41,22 +56,562 @@ float flagShear = 0.0f;
 bool shearDir = true;
 float flagTime = 0.0f;
 
+// Animation ticks since initScene; scene file objects animate from it
+uint32_t sceneTick = 0;
+
+
+// ------------------- Render Target -------------------
+// TARGET_GL_POINTS sends every pixel to GL as a point (the original path).
+// TARGET_FRAMEBUFFER rasterizes into a plain RGBA memory buffer that is
+// uploaded once per frame, so the rasterizers need no GL context at all.
+// TARGET_GL_BATCHED records the frame like the framebuffer target and
+// submits its spans to GL as a few vertex-array draws (see submitBatched).
+enum RenderTarget { TARGET_GL_POINTS, TARGET_FRAMEBUFFER, TARGET_GL_BATCHED };
+RenderTarget renderTarget = TARGET_GL_POINTS;
+long glDrawCalls = 0;   // glBegin/glEnd pairs and glDrawArrays calls issued so far
+
+const int SCENE_W = 900, SCENE_H = 700;   // logical scene units; see Output Mapping
+
+// RGBA8 pixels packed as R | G << 8 | B << 16 | A << 24 (byte order R,G,B,A),
+// row 0 at the bottom to match gluOrtho2D and glDrawPixels. The size comes
+// from the render target, not from the scene.
+struct Framebuffer {
+    int width = 0, height = 0;
+    vector<uint32_t> pixels;
+
+    void resize(int w, int h) {
+        width = w; height = h;
+        pixels.assign((size_t)w * h, 0);
+    }
+    void clear(uint32_t c) { std::fill(pixels.begin(), pixels.end(), c); }
+    uint32_t* row(int y) { return pixels.data() + (size_t)y * width; }
+};
+Framebuffer frame;
+
+uint32_t packColor(float r, float g, float b, float a) {
+    auto to8 = [](float v) { return (uint32_t)(max(0.0f, min(1.0f, v)) * 255.0f + 0.5f); };
+    return to8(r) | (to8(g) << 8) | (to8(b) << 16) | (to8(a) << 24);
+}
+
+// Source-over blend of src onto dst, rounding x/255 exactly.
+inline uint32_t blendOver(uint32_t dst, uint32_t src) {
+    uint32_t a = src >> 24;
+    if (a == 255) return src;
+    if (a == 0) return dst;
+    uint32_t out = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+        uint32_t s = (shift == 24) ? 255 : (src >> shift) & 0xFF;
+        uint32_t d = (dst >> shift) & 0xFF;
+        uint32_t t = s * a + d * (255 - a) + 128;
+        out |= ((t + (t >> 8)) >> 8) << shift;
+    }
+    return out;
+}
+
+// Colour premultiplied by its alpha, alpha kept in the top byte; additive
+// blending is then a saturating byte-wise add of this value.
+inline uint32_t premultiply(uint32_t src) {
+    uint32_t a = src >> 24, out = a << 24;
+    for (int shift = 0; shift < 24; shift += 8) {
+        uint32_t t = ((src >> shift) & 0xFF) * a + 128;
+        out |= ((t + (t >> 8)) >> 8) << shift;
+    }
+    return out;
+}
+
+inline uint32_t addSaturate(uint32_t dst, uint32_t add) {
+    uint32_t out = 0;
+    for (int shift = 0; shift < 32; shift += 8)
+        out |= min(255u, ((dst >> shift) & 0xFF) + ((add >> shift) & 0xFF)) << shift;
+    return out;
+}
+
+// ------------------- Span Kernels -------------------
+// Each kernel writes n pixels of one colour. The SIMD versions produce the
+// same bytes as the scalar ones, so the choice never changes the image.
+typedef void (*SpanKernel)(uint32_t* dst, int n, uint32_t color);
+struct SpanKernels {
+    const char* name;
+    SpanKernel fill;   // opaque
+    SpanKernel over;   // source-over with the colour's alpha
+    SpanKernel add;    // additive, colour weighted by its alpha
+};
+
+void fillScalar(uint32_t* dst, int n, uint32_t c) { std::fill(dst, dst + n, c); }
+void overScalar(uint32_t* dst, int n, uint32_t c) { for (int i = 0; i < n; i++) dst[i] = blendOver(dst[i], c); }
+void addScalar(uint32_t* dst, int n, uint32_t c) {
+    uint32_t p = premultiply(c);
+    for (int i = 0; i < n; i++) dst[i] = addSaturate(dst[i], p);
+}
+
+#ifdef PARK_X86_SIMD
+// Source-over per 16-bit channel: t = d * (255 - a) + (s * a + 128), then
+// (t + (t >> 8)) >> 8. Two pixels per 128-bit lane after widening.
+__attribute__((target("sse2"))) void fillSSE2(uint32_t* dst, int n, uint32_t c) {
+    __m128i v = _mm_set1_epi32((int)c);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm_storeu_si128((__m128i*)(dst + i), v);
+        _mm_storeu_si128((__m128i*)(dst + i + 4), v);
+    }
+    for (; i < n; i++) dst[i] = c;
+}
+
+__attribute__((target("sse2"))) void overSSE2(uint32_t* dst, int n, uint32_t c) {
+    uint32_t a = c >> 24;
+    if (a == 0) return;
+    if (a == 255) { fillSSE2(dst, n, c); return; }
+    uint16_t k[4];
+    for (int ch = 0; ch < 4; ch++) k[ch] = (uint16_t)((ch == 3 ? 255 : (c >> (ch * 8)) & 0xFF) * a + 128);
+    __m128i add = _mm_setr_epi16(k[0], k[1], k[2], k[3], k[0], k[1], k[2], k[3]);
+    __m128i inv = _mm_set1_epi16((short)(255 - a));
+    __m128i zero = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+        __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), inv), add);
+        __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), inv), add);
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(lo, hi));
+    }
+    for (; i < n; i++) dst[i] = blendOver(dst[i], c);
+}
+
+__attribute__((target("sse2"))) void addSSE2(uint32_t* dst, int n, uint32_t c) {
+    uint32_t p = premultiply(c);
+    __m128i v = _mm_set1_epi32((int)p);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_adds_epu8(d, v));
+    }
+    for (; i < n; i++) dst[i] = addSaturate(dst[i], p);
+}
+
+__attribute__((target("avx2"))) void fillAVX2(uint32_t* dst, int n, uint32_t c) {
+    __m256i v = _mm256_set1_epi32((int)c);
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        _mm256_storeu_si256((__m256i*)(dst + i), v);
+        _mm256_storeu_si256((__m256i*)(dst + i + 8), v);
+    }
+    for (; i + 8 <= n; i += 8) _mm256_storeu_si256((__m256i*)(dst + i), v);
+    for (; i < n; i++) dst[i] = c;
+}
+
+__attribute__((target("avx2"))) void overAVX2(uint32_t* dst, int n, uint32_t c) {
+    uint32_t a = c >> 24;
+    if (a == 0) return;
+    if (a == 255) { fillAVX2(dst, n, c); return; }
+    uint16_t k[4];
+    for (int ch = 0; ch < 4; ch++) k[ch] = (uint16_t)((ch == 3 ? 255 : (c >> (ch * 8)) & 0xFF) * a + 128);
+    __m256i add = _mm256_setr_epi16(k[0], k[1], k[2], k[3], k[0], k[1], k[2], k[3],
+                                    k[0], k[1], k[2], k[3], k[0], k[1], k[2], k[3]);
+    __m256i inv = _mm256_set1_epi16((short)(255 - a));
+    __m256i zero = _mm256_setzero_si256();
+    int i = 0;
+    // unpack and pack both work within 128-bit lanes, so pixel order survives
+    for (; i + 8 <= n; i += 8) {
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+        __m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), inv), add);
+        __m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), inv), add);
+        lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+        hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_packus_epi16(lo, hi));
+    }
+    for (; i < n; i++) dst[i] = blendOver(dst[i], c);
+}
+
+__attribute__((target("avx2"))) void addAVX2(uint32_t* dst, int n, uint32_t c) {
+    uint32_t p = premultiply(c);
+    __m256i v = _mm256_set1_epi32((int)p);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_adds_epu8(d, v));
+    }
+    for (; i < n; i++) dst[i] = addSaturate(dst[i], p);
+}
+#endif
+
+const SpanKernels scalarKernels = { "scalar", fillScalar, overScalar, addScalar };
+#ifdef PARK_X86_SIMD
+const SpanKernels sse2Kernels = { "sse2", fillSSE2, overSSE2, addSSE2 };
+const SpanKernels avx2Kernels = { "avx2", fillAVX2, overAVX2, addAVX2 };
+#endif
+const SpanKernels* spanKernels = &scalarKernels;
+
+// Picks the widest kernel set the CPU supports, or the named one ("scalar",
+// "sse2", "avx2") when it is available. Returns false for an unknown name.
+bool selectSpanKernels(const char* name = nullptr) {
+    const SpanKernels* best = &scalarKernels;
+#ifdef PARK_X86_SIMD
+    __builtin_cpu_init();
+    bool hasSSE2 = __builtin_cpu_supports("sse2"), hasAVX2 = __builtin_cpu_supports("avx2");
+    if (hasSSE2) best = &sse2Kernels;
+    if (hasAVX2) best = &avx2Kernels;
+    if (name && strcmp(name, "sse2") == 0 && hasSSE2) { spanKernels = &sse2Kernels; return true; }
+    if (name && strcmp(name, "avx2") == 0 && hasAVX2) { spanKernels = &avx2Kernels; return true; }
+#endif
+    if (name && strcmp(name, "scalar") == 0) { spanKernels = &scalarKernels; return true; }
+    spanKernels = best;
+    return name == nullptr;
+}
+
+// Current drawing colour and blend mode, shared by both targets. A scene
+// file object's tint (packed like drawColor, 0 = none) multiplies every
+// colour its element function sets.
+enum BlendMode : uint8_t { BLEND_OVER, BLEND_ADD };
+uint32_t drawColor = 0xFF000000;
+uint32_t drawTint = 0;
+BlendMode blendMode = BLEND_OVER;
+
+void setColor(float r, float g, float b, float a = 1.0f) {
+    if (drawTint) {
+        r *= (drawTint & 255) / 255.0f; g *= (drawTint >> 8 & 255) / 255.0f;
+        b *= (drawTint >> 16 & 255) / 255.0f; a *= (drawTint >> 24) / 255.0f;
+    }
+    drawColor = packColor(r, g, b, a);
+    if (renderTarget == TARGET_GL_POINTS) glColor4f(r, g, b, a);
+}
+
+void setBlendMode(BlendMode mode) {
+    blendMode = mode;
+    if (renderTarget == TARGET_GL_POINTS)
+        glBlendFunc(GL_SRC_ALPHA, mode == BLEND_ADD ? GL_ONE : GL_ONE_MINUS_SRC_ALPHA);
+}
+
+inline void blendSpan(uint32_t* p, int n, uint32_t color, BlendMode mode) {
+    if (mode == BLEND_ADD) spanKernels->add(p, n, color);
+    else if ((color >> 24) == 255) spanKernels->fill(p, n, color);
+    else spanKernels->over(p, n, color);
+}
+
+inline void blendPixel(uint32_t& p, uint32_t color, BlendMode mode) {
+    p = (mode == BLEND_ADD) ? addSaturate(p, premultiply(color)) : blendOver(p, color);
+}
+
+// ------------------- 2D Transform -------------------
+// Software replacement for glTranslatef/glRotatef/glMultMatrixf, mirroring
+// the custom_* matrix stack of the 3D scene. drawLine, drawCircle,
+// fillCircle and scanlineFill map their coordinates through modelMatrix
+// before rasterizing, so rotated and sheared shapes are filled in device
+// space (no holes) and both targets draw the same pixels with the GL
+// modelview left at identity.
+struct Matrix3 {
+    // affine rows of a 3x3 matrix: x' = a*x + c*y + e, y' = b*x + d*y + f
+    float a, b, c, d, e, f;
+
+    Matrix3() : a(1), b(0), c(0), d(1), e(0), f(0) {}
+    Matrix3(float a, float b, float c, float d, float e, float f) : a(a), b(b), c(c), d(d), e(e), f(f) {}
+
+    static Matrix3 createTranslation(float x, float y) { return Matrix3(1, 0, 0, 1, x, y); }
+    static Matrix3 createScale(float sx, float sy) { return Matrix3(sx, 0, 0, sy, 0, 0); }
+    // counter-clockwise, in degrees, like glRotatef about z
+    static Matrix3 createRotation(float angle) {
+        float rad = angle * (float)M_PI / 180.0f;
+        float s = sinf(rad), co = cosf(rad);
+        return Matrix3(co, s, -s, co, 0, 0);
+    }
+    // x' = x + shx*y, y' = shy*x + y
+    static Matrix3 createShear(float shx, float shy) { return Matrix3(1, shy, shx, 1, 0, 0); }
+
+    Matrix3 operator*(const Matrix3& o) const {
+        return Matrix3(a * o.a + c * o.b, b * o.a + d * o.b,
+                       a * o.c + c * o.d, b * o.c + d * o.d,
+                       a * o.e + c * o.f + e, b * o.e + d * o.f + f);
+    }
+
+    bool isIdentity() const { return a == 1 && b == 0 && c == 0 && d == 1 && e == 0 && f == 0; }
+    pair<int, int> apply(int x, int y) const {
+        return { (int)round(a * x + c * y + e), (int)round(b * x + d * y + f) };
+    }
+    // linear size change (exact for rotations and uniform scales)
+    float radiusScale() const { return sqrtf(fabsf(a * d - b * c)); }
+};
+
+Matrix3 deviceMatrix;   // scene units to device pixels, set by setOutputSize
+Matrix3 modelMatrix;
+vector<Matrix3> matrixStack;
+vector<pair<int, int>> transformedVertices;   // scratch for scanlineFill
+
+void custom_push_matrix() { matrixStack.push_back(modelMatrix); }
+void custom_pop_matrix() { modelMatrix = matrixStack.back(); matrixStack.pop_back(); }
+// identity in scene units, i.e. back to the plain device mapping
+void custom_load_identity() { modelMatrix = deviceMatrix; }
+// through a local, as in the 3D scene (GCC 12 aliases the return slot)
+void custom_translate(float x, float y) { Matrix3 r = modelMatrix * Matrix3::createTranslation(x, y); modelMatrix = r; }
+void custom_rotate(float angle) { Matrix3 r = modelMatrix * Matrix3::createRotation(angle); modelMatrix = r; }
+void custom_scale(float sx, float sy) { Matrix3 r = modelMatrix * Matrix3::createScale(sx, sy); modelMatrix = r; }
+void custom_shear(float shx, float shy) { Matrix3 r = modelMatrix * Matrix3::createShear(shx, shy); modelMatrix = r; }
+
+// ------------------- Output Mapping -------------------
+// The scene is authored in SCENE_W x SCENE_H units. setOutputSize() picks
+// the device size (window, --size, times --supersample) and builds
+// deviceMatrix: one uniform scale so nothing is stretched, centred with
+// black bars on the longer axis. Everything the scene draws goes through
+// modelMatrix, which starts from deviceMatrix, and is clipped to the
+// centred viewport. At 900x700 the mapping is the identity and every
+// primitive takes its untransformed path.
+struct Rect { int x0, y0, x1, y1; };   // inclusive pixel bounds
+
+int outputW = SCENE_W, outputH = SCENE_H;   // pixels presented or written
+int supersample = 1;                        // device pixels per output pixel, each axis
+float deviceScale = 1;
+Rect deviceViewport = { 0, 0, SCENE_W - 1, SCENE_H - 1 };
+int sparkSize = 2;                          // firework particle side, in device pixels
+int strokeWidth = 1;                        // line and circle outline width, in device pixels
+Framebuffer outputFrame;                    // box-filtered frame when supersampling
+
+void setOutputSize(int w, int h) {
+    outputW = max(w, 1); outputH = max(h, 1);
+    int dw = outputW * supersample, dh = outputH * supersample;
+    frame.resize(dw, dh);
+    outputFrame.resize(supersample > 1 ? outputW : 0, supersample > 1 ? outputH : 0);
+    deviceScale = min((float)dw / SCENE_W, (float)dh / SCENE_H);
+    int vw = max(1, (int)lround(SCENE_W * deviceScale)), vh = max(1, (int)lround(SCENE_H * deviceScale));
+    int ox = (dw - vw) / 2, oy = (dh - vh) / 2;
+    deviceViewport = { ox, oy, ox + vw - 1, oy + vh - 1 };
+    if (deviceScale == 1 && ox == 0 && oy == 0) deviceMatrix = Matrix3();
+    else deviceMatrix = Matrix3(deviceScale, 0, 0, deviceScale, (float)ox, (float)oy);
+    modelMatrix = deviceMatrix;
+    matrixStack.clear();
+    sparkSize = max(1, (int)lround(2 * deviceScale));
+    strokeWidth = max(1, min(255, (int)lround(deviceScale)));
+}
+
+Rect viewportRect() { return deviceViewport; }
+
+// Device pixels covering scene rectangle [x0, x1] x [y0, y1] (inclusive),
+// widened by a pixel for rounding.
+Rect deviceRect(int x0, int y0, int x1, int y1) {
+    if (deviceMatrix.isIdentity()) return { x0, y0, x1, y1 };
+    const Matrix3& m = deviceMatrix;
+    return { (int)floorf(x0 * m.a + m.e) - 1, (int)floorf(y0 * m.d + m.f) - 1,
+             (int)ceilf((x1 + 1) * m.a + m.e), (int)ceilf((y1 + 1) * m.d + m.f) };
+}
+
+// ------------------- Draw Commands -------------------
+// The framebuffer target never rasterizes while the scene functions run:
+// lines, circles, polygons and firework sparks are recorded into a
+// CommandBuffer (already in device coordinates, with their colour and blend
+// mode) and rasterized tile by tile in rasterizeCommands(). Polygon
+// vertices and sparks go into shared arrays, so recording allocates nothing
+// once the buffers have grown to a frame's worth. The GL target draws
+// immediately.
+
+enum CommandType : uint8_t { CMD_LINE, CMD_CIRCLE, CMD_FILL_CIRCLE, CMD_POLYGON, CMD_SPARKS, CMD_SPRITE };
+struct DrawCommand {
+    CommandType type;
+    BlendMode blend;
+    uint8_t width;    // stroke width of lines and circle outlines
+    uint32_t color;
+    int a, b, c, d;   // line: x0 y0 x1 y1 | circle: xc yc r | polygon, sparks: first element, count
+                      // | sprite: index into sprites, x, y
+    Rect bounds;      // clipped to the viewport
+};
+
+// One additive 2x2 firework particle, colour already premultiplied.
+struct Spark { int x, y; uint32_t add; };
+
+struct Sprite;
+
+struct CommandBuffer {
+    bool hasClear = false;   // fill the frame with clearColor before the commands
+    uint32_t clearColor = 0;
+    vector<DrawCommand> commands;
+    vector<pair<int, int>> vertices;
+    vector<Spark> sparks;
+    vector<shared_ptr<const Sprite>> sprites;   // keeps evicted sprites alive until replayed
+
+    void clear() { hasClear = false; commands.clear(); vertices.clear(); sparks.clear(); sprites.clear(); }
+};
+
+int rasterThreads = 0;
+CommandBuffer immediateCommands;                // outside recordFrame(), until flushBins()
+CommandBuffer* recording = &immediateCommands;  // where the scene functions record
+
+bool recordingActive() { return renderTarget != TARGET_GL_POINTS; }
+void flushBins();
+
+void recordCommand(CommandType type, int a, int b, int c, int d, Rect bounds) {
+    const Rect& view = deviceViewport;
+    bounds.x0 = max(bounds.x0, view.x0); bounds.y0 = max(bounds.y0, view.y0);
+    bounds.x1 = min(bounds.x1, view.x1); bounds.y1 = min(bounds.y1, view.y1);
+    if (bounds.x0 > bounds.x1 || bounds.y0 > bounds.y1) return;
+    recording->commands.push_back({ type, blendMode, (uint8_t)strokeWidth, drawColor, a, b, c, d, bounds });
+}
+
+void recordPolygon(const pair<int, int>* vertices, size_t n) {
+    if (n < 3) return;
+    Rect b = { vertices[0].first, vertices[0].second, vertices[0].first, vertices[0].second };
+    for (size_t i = 1; i < n; i++) {
+        b.x0 = min(b.x0, vertices[i].first); b.x1 = max(b.x1, vertices[i].first);
+        b.y0 = min(b.y0, vertices[i].second); b.y1 = max(b.y1, vertices[i].second);
+    }
+    // spans round edge x, so a polygon can reach one pixel past its vertices
+    b.x0--; b.x1++;
+    vector<pair<int, int>>& shared = recording->vertices;
+    size_t first = shared.size();
+    size_t before = recording->commands.size();
+    recordCommand(CMD_POLYGON, (int)first, (int)n, 0, 0, b);
+    if (recording->commands.size() != before) shared.insert(shared.end(), vertices, vertices + n);
+}
+
+// Black bars, then the sky inside the viewport only.
+void glClearViewport(float r, float g, float b) {
+    const Rect& view = deviceViewport;
+    glClearColor(0, 0, 0, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+    glEnable(GL_SCISSOR_TEST);
+    glScissor(view.x0, view.y0, view.x1 - view.x0 + 1, view.y1 - view.y0 + 1);
+    glClearColor(r, g, b, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+    glDisable(GL_SCISSOR_TEST);
+}
+
+void clearFrame(float r, float g, float b) {
+    if (recordingActive()) {
+        // everything recorded so far would be overwritten anyway
+        recording->clear();
+        recording->hasClear = true;
+        recording->clearColor = packColor(r, g, b, 1.0f);
+        return;
+    }
+    glClearViewport(r, g, b);
+}
+
+// One transfer per frame; the only GL call the framebuffer target makes.
+bool headless = false;   // no GL context: presentFrame only finishes the frame
+
+// The image to show or write: the framebuffer itself, or its box-filtered
+// copy when supersampling (see resolveFrame).
+const Framebuffer& displayedFrame() { return supersample > 1 ? outputFrame : frame; }
+
+void presentFrame() {
+    TRACE_FUNCTION();
+    if (renderTarget == TARGET_FRAMEBUFFER) {
+        if (headless) return;
+        const Framebuffer& out = displayedFrame();
+        glDisable(GL_BLEND);
+        glRasterPos2i(0, 0);
+        glDrawPixels(out.width, out.height, GL_RGBA, GL_UNSIGNED_BYTE, out.pixels.data());
+        glEnable(GL_BLEND);
+    }
+    glFlush();
+}
+
+// ------------------- Clipping -------------------
+// Geometry is clipped to the viewport after the model transform and before
+// it is recorded or drawn: a primitive whose bounding box misses the window
+// costs one box test, lines are cut with Cohen-Sutherland and polygons with
+// Sutherland-Hodgman, so the rasterizers never walk off-screen pixels or
+// see coordinates far outside the window. Anything entirely inside is left
+// untouched and rasterizes exactly as before.
+
+enum ClipResult { CLIP_REJECT, CLIP_PARTIAL, CLIP_ACCEPT };
+
+ClipResult classifyBounds(const Rect& b, const Rect& view) {
+    if (b.x1 < view.x0 || b.x0 > view.x1 || b.y1 < view.y0 || b.y0 > view.y1) return CLIP_REJECT;
+    if (b.x0 >= view.x0 && b.x1 <= view.x1 && b.y0 >= view.y0 && b.y1 <= view.y1) return CLIP_ACCEPT;
+    return CLIP_PARTIAL;
+}
+
+enum { OUT_LEFT = 1, OUT_RIGHT = 2, OUT_BOTTOM = 4, OUT_TOP = 8 };
+
+int outCode(double x, double y, const Rect& view) {
+    int code = 0;
+    if (x < view.x0) code |= OUT_LEFT;
+    else if (x > view.x1) code |= OUT_RIGHT;
+    if (y < view.y0) code |= OUT_BOTTOM;
+    else if (y > view.y1) code |= OUT_TOP;
+    return code;
+}
+
+// Cohen-Sutherland: moves outside endpoints onto the view edges; false if
+// the segment misses the view.
+bool clipLine(int& x0, int& y0, int& x1, int& y1, const Rect& view) {
+    double ax = x0, ay = y0, bx = x1, by = y1;
+    int codeA = outCode(ax, ay, view), codeB = outCode(bx, by, view);
+    if (!(codeA | codeB)) return true;
+    while (codeA | codeB) {
+        if (codeA & codeB) return false;
+        int out = codeA ? codeA : codeB;
+        double x, y;
+        if (out & OUT_TOP) { x = ax + (bx - ax) * (view.y1 - ay) / (by - ay); y = view.y1; }
+        else if (out & OUT_BOTTOM) { x = ax + (bx - ax) * (view.y0 - ay) / (by - ay); y = view.y0; }
+        else if (out & OUT_RIGHT) { y = ay + (by - ay) * (view.x1 - ax) / (bx - ax); x = view.x1; }
+        else { y = ay + (by - ay) * (view.x0 - ax) / (bx - ax); x = view.x0; }
+        if (out == codeA) { ax = x; ay = y; codeA = outCode(ax, ay, view); }
+        else { bx = x; by = y; codeB = outCode(bx, by, view); }
+    }
+    x0 = (int)round(ax); y0 = (int)round(ay);
+    x1 = (int)round(bx); y1 = (int)round(by);
+    return true;
+}
+
+// Sutherland-Hodgman against the four edges of view, in floating point and
+// rounded once at the end. The scratch buffers only grow.
+struct ClipPoint { float x, y; };
+vector<ClipPoint> clipIn, clipOut;
+vector<pair<int, int>> clippedVertices;
+
+size_t clipPolygon(const pair<int, int>* vertices, size_t n, const Rect& view) {
+    clipIn.resize(n);
+    for (size_t i = 0; i < n; i++) clipIn[i] = { (float)vertices[i].first, (float)vertices[i].second };
+    for (int edge = 0; edge < 4 && !clipIn.empty(); edge++) {
+        // signed distance inside the edge: >= 0 keeps the point
+        auto inside = [&view, edge](const ClipPoint& p) {
+            switch (edge) {
+            case 0: return p.x - view.x0;
+            case 1: return view.x1 - p.x;
+            case 2: return p.y - view.y0;
+            default: return view.y1 - p.y;
+            }
+        };
+        clipOut.clear();
+        ClipPoint prev = clipIn.back();
+        float dPrev = inside(prev);
+        for (const ClipPoint& cur : clipIn) {
+            float dCur = inside(cur);
+            if ((dPrev >= 0) != (dCur >= 0)) {
+                float t = dPrev / (dPrev - dCur);
+                clipOut.push_back({ prev.x + (cur.x - prev.x) * t, prev.y + (cur.y - prev.y) * t });
+            }
+            if (dCur >= 0) clipOut.push_back(cur);
+            prev = cur; dPrev = dCur;
+        }
+        clipIn.swap(clipOut);
+    }
+    clippedVertices.resize(clipIn.size());
+    for (size_t i = 0; i < clipIn.size(); i++)
+        clippedVertices[i] = { (int)round(clipIn[i].x), (int)round(clipIn[i].y) };
+    return clippedVertices.size();
+}
 
 // ------------------- Helper: Pixel -------------------
+// GL target only; the framebuffer plots through TileSink.
 void setPixel(int x, int y) {
+    glDrawCalls++;
     glBegin(GL_POINTS);
     glVertex2i(x, y);
     glEnd();
 }
 
+// Strokes wider than a pixel stamp a width x width square at each step,
+// covering [x - strokeLow(w), x - strokeLow(w) + w - 1] on both axes.
+inline int strokeLow(int width) { return (width - 1) / 2; }
+
 // ------------------- Bresenham Line -------------------
-void drawLine(int x0, int y0, int x1, int y1) {
+template <class Plot>
+void rasterLine(int x0, int y0, int x1, int y1, Plot plot) {
     int dx = abs(x1 - x0), dy = abs(y1 - y0);
     int sx = (x0 < x1) ? 1 : -1;
     int sy = (y0 < y1) ? 1 : -1;
     int err = dx - dy;
     while (true) {
-        setPixel(x0, y0);
+        plot(x0, y0);
         if (x0 == x1 && y0 == y1) break;
         int e2 = 2 * err;
         if (e2 > -dy) { err -= dy; x0 += sx; }
@@ -64,235 +619,1019 @@ void drawLine(int x0, int y0, int x1, int y1) {
     }
 }
 
+void drawLine(int x0, int y0, int x1, int y1) {
+    if (!modelMatrix.isIdentity()) {
+        tie(x0, y0) = modelMatrix.apply(x0, y0);
+        tie(x1, y1) = modelMatrix.apply(x1, y1);
+    }
+    if (!clipLine(x0, y0, x1, y1, viewportRect())) return;
+    if (recordingActive()) {
+        int lo = strokeLow(strokeWidth), hi = strokeWidth - 1 - lo;
+        recordCommand(CMD_LINE, x0, y0, x1, y1,
+                      { min(x0, x1) - lo, min(y0, y1) - lo, max(x0, x1) + hi, max(y0, y1) + hi });
+        return;
+    }
+    glPointSize((float)strokeWidth);
+    rasterLine(x0, y0, x1, y1, setPixel);
+    glPointSize(1.0f);
+}
+
 // ------------------- Midpoint Circle -------------------
-void drawCircle(int xc, int yc, int r) {
+template <class Plot>
+void rasterCircle(int xc, int yc, int r, Plot plot) {
     int x = 0, y = r;
     int p = 1 - r;
     while (x <= y) {
-        setPixel(xc + x, yc + y); setPixel(xc - x, yc + y);
-        setPixel(xc + x, yc - y); setPixel(xc - x, yc - y);
-        setPixel(xc + y, yc + x); setPixel(xc - y, yc + x);
-        setPixel(xc + y, yc - x); setPixel(xc - y, yc - x);
+        plot(xc + x, yc + y); plot(xc - x, yc + y);
+        plot(xc + x, yc - y); plot(xc - x, yc - y);
+        plot(xc + y, yc + x); plot(xc - y, yc + x);
+        plot(xc + y, yc - x); plot(xc - y, yc - x);
         if (p < 0) p += 2 * x + 3;
         else { p += 2 * (x - y) + 5; y--; }
         x++;
     }
 }
 
+// Circles stay circles: the centre is mapped and the radius scaled, so a
+// shear draws the circle of equal area rather than an ellipse.
+void transformCircle(int& xc, int& yc, int& r) {
+    if (modelMatrix.isIdentity()) return;
+    tie(xc, yc) = modelMatrix.apply(xc, yc);
+    r = (int)round(r * modelMatrix.radiusScale());
+}
+
+void drawCircle(int xc, int yc, int r) {
+    transformCircle(xc, yc, r);
+    Rect view = viewportRect();
+    ClipResult clip = classifyBounds({ xc - r, yc - r, xc + r, yc + r }, view);
+    if (clip == CLIP_REJECT) return;
+    if (recordingActive()) {
+        int lo = strokeLow(strokeWidth), hi = strokeWidth - 1 - lo;
+        recordCommand(CMD_CIRCLE, xc, yc, r, 0, { xc - r - lo, yc - r - lo, xc + r + hi, yc + r + hi });
+        return;
+    }
+    glPointSize((float)strokeWidth);
+    if (clip == CLIP_ACCEPT) rasterCircle(xc, yc, r, setPixel);
+    else rasterCircle(xc, yc, r, [&view](int x, int y) {
+        if (x >= view.x0 && x <= view.x1 && y >= view.y0 && y <= view.y1) setPixel(x, y);
+    });
+    glPointSize(1.0f);
+}
+
+// ------------------- Stage Counters -------------------
+// With --perf the rasterizer's stages count cycles, instructions, cache and
+// branch misses (see perf_counters.h), reported per unit at exit: building
+// a polygon's edge table, walking rows into spans, and blending spans into
+// the framebuffer. "frame other" is the rest of display(): recording the
+// scene, binning, resolve and present.
+PerfStage perfEdgeTable("edge table", "edge");
+PerfStage perfSpanWalk("span walk", "row");
+PerfStage perfBlend("blend", "pixel");
+PerfStage perfFrameOther("frame other", "frame");
+
+// ------------------- Span Sinks -------------------
+// The fill engine produces horizontal spans [x0, x1] on row y and hands them
+// to a sink, which decides what a span becomes (GL points, framebuffer
+// writes, ...). begin()/end() bracket one primitive.
+struct SpanSink {
+    virtual ~SpanSink() {}
+    virtual void begin() {}
+    virtual void span(int y, int x0, int x1) = 0;
+    virtual void end() {}
+};
+
+struct GLPointSink : SpanSink {
+    void begin() override { glDrawCalls++; glBegin(GL_POINTS); }
+    void span(int y, int x0, int x1) override {
+        const Rect& view = deviceViewport;
+        if (y < view.y0 || y > view.y1) return;
+        x0 = max(x0, view.x0); x1 = min(x1, view.x1);
+        for (int x = x0; x <= x1; x++) glVertex2i(x, y);
+    }
+    void end() override { glEnd(); }
+};
+
+GLPointSink glPointSink;
+
 // ------------------- Scanline Fill -------------------
+// Edge-table storage persists across calls: buckets are indexed by y - ymin
+// and only grow, edges live in one pool linked per bucket, and the active
+// edge table stays sorted by insertion, so a fill allocates nothing once
+// the buffers have warmed up to the largest polygon seen. Each raster
+// thread owns one FillScratch; the serial path uses fillScratch.
 struct Edge { int ymax; float x, inv_m; };
-vector<vector<Edge>> ET(800);
-vector<Edge> AET;
-
-void scanlineFill(vector<pair<int, int>> vertices, float r, float g, float b, float a) {
+struct FillScratch {
+    vector<int> ET;   // head of each bucket in edgePool, -1 if empty; grows to the tallest polygon
+    vector<Edge> edgePool;
+    vector<int> edgeNext;
+    vector<Edge> AET;
+    vector<int> circleHalfWidth;
+};
+FillScratch fillScratch;
+
+// Rows outside [clipY0, clipY1] are stepped but not emitted, so a clipped
+// fill produces exactly the spans of the full fill on the rows it keeps.
+void fillPolygon(const pair<int, int>* vertices, size_t n, SpanSink& sink, FillScratch& fs = fillScratch,
+                 int clipY0 = INT_MIN, int clipY1 = INT_MAX) {
+    if (n < 3) return;
+    vector<int>& ET = fs.ET;
+    vector<Edge>& AET = fs.AET;
     int ymin = vertices[0].second, ymax = vertices[0].second;
-    for (auto& v : vertices) { ymin = min(ymin, v.second); ymax = max(ymax, v.second); }
-    ET.assign(800, {}); AET.clear();
+    for (size_t i = 1; i < n; i++) { ymin = min(ymin, vertices[i].second); ymax = max(ymax, vertices[i].second); }
+    size_t rows = (size_t)(ymax - ymin) + 1;
+    PERF_SCOPE(perfSpanWalk, rows);
+    {
+        PERF_SCOPE(perfEdgeTable, n);
+        if (ET.size() < rows) ET.resize(rows, -1);
+        std::fill(ET.begin(), ET.begin() + rows, -1);
+        fs.edgePool.clear(); fs.edgeNext.clear(); AET.clear();
+
+        for (size_t i = 0; i < n; i++) {
+            int x0 = vertices[i].first, y0 = vertices[i].second;
+            int x1 = vertices[(i + 1) % n].first, y1 = vertices[(i + 1) % n].second;
+            if (y0 == y1) continue;
+            int minY = min(y0, y1), maxY = max(y0, y1);
+            float x_at_ymin = (y0 < y1) ? x0 : x1;
+            float inv_m = (float)(x1 - x0) / (y1 - y0);
+            fs.edgePool.push_back({ maxY,x_at_ymin,inv_m });
+            fs.edgeNext.push_back(ET[minY - ymin]);
+            ET[minY - ymin] = (int)fs.edgePool.size() - 1;
+        }
+    }
 
-    for (size_t i = 0; i < vertices.size(); i++) {
-        int x0 = vertices[i].first, y0 = vertices[i].second;
-        int x1 = vertices[(i + 1) % vertices.size()].first, y1 = vertices[(i + 1) % vertices.size()].second;
-        if (y0 == y1) continue;
-        int minY = min(y0, y1), maxY = max(y0, y1);
-        float x_at_ymin = (y0 < y1) ? x0 : x1;
-        float inv_m = (float)(x1 - x0) / (y1 - y0);
-        ET[minY].push_back({ maxY,x_at_ymin,inv_m });
+    sink.begin();
+    for (int y = ymin; y <= min(ymax, clipY1); y++) {
+        // retire edges that end on this row, keeping the rest in order
+        size_t kept = 0;
+        for (size_t i = 0; i < AET.size(); i++)
+            if (AET[i].ymax != y) AET[kept++] = AET[i];
+        AET.resize(kept);
+        // insert edges that start here at their sorted position
+        for (int k = ET[y - ymin]; k >= 0; k = fs.edgeNext[k]) {
+            const Edge& e = fs.edgePool[k];
+            if (e.ymax == y) continue;
+            size_t j = AET.size();
+            AET.push_back(e);
+            while (j > 0 && AET[j - 1].x > e.x) { AET[j] = AET[j - 1]; j--; }
+            AET[j] = e;
+        }
+        if (y >= clipY0) {
+            for (size_t i = 0; i + 1 < AET.size(); i += 2) {
+                int xStart = (int)round(AET[i].x), xEnd = (int)round(AET[i + 1].x);
+                sink.span(y, xStart, xEnd);
+            }
+        }
+        // step and restore order; edges rarely cross, so this is near-linear
+        for (size_t i = 0; i < AET.size(); i++) {
+            Edge e = AET[i];
+            e.x += e.inv_m;
+            size_t j = i;
+            while (j > 0 && AET[j - 1].x > e.x) { AET[j] = AET[j - 1]; j--; }
+            AET[j] = e;
+        }
     }
+    sink.end();
+}
 
-    glColor4f(r, g, b, a);
-    glBegin(GL_POINTS);
-    for (int y = ymin; y <= ymax; y++) {
-        for (auto e : ET[y]) AET.push_back(e);
-        AET.erase(remove_if(AET.begin(), AET.end(), [y](Edge e) {return e.ymax == y; }), AET.end());
-        sort(AET.begin(), AET.end(), [](Edge a, Edge b) {return a.x < b.x; });
-        for (size_t i = 0; i + 1 < AET.size(); i += 2) {
-            int xStart = (int)round(AET[i].x), xEnd = (int)round(AET[i + 1].x);
-            for (int x = xStart; x <= xEnd; x++) glVertex2i(x, y);
+void scanlineFill(const pair<int, int>* vertices, size_t n, float r, float g, float b, float a) {
+    setColor(r, g, b, a);
+    if (!modelMatrix.isIdentity()) {
+        transformedVertices.resize(n);
+        for (size_t i = 0; i < n; i++)
+            transformedVertices[i] = modelMatrix.apply(vertices[i].first, vertices[i].second);
+        vertices = transformedVertices.data();
+    }
+    if (n < 3) return;
+    Rect bounds = { vertices[0].first, vertices[0].second, vertices[0].first, vertices[0].second };
+    for (size_t i = 1; i < n; i++) {
+        bounds.x0 = min(bounds.x0, vertices[i].first); bounds.x1 = max(bounds.x1, vertices[i].first);
+        bounds.y0 = min(bounds.y0, vertices[i].second); bounds.y1 = max(bounds.y1, vertices[i].second);
+    }
+    // one pixel of guard band: spans round edge x, so a polygon can reach one
+    // pixel past its vertices, and shapes that just touch the window edge
+    // (the ground, the road) stay unclipped
+    Rect view = viewportRect();
+    Rect guard = { view.x0 - 1, view.y0 - 1, view.x1 + 1, view.y1 + 1 };
+    ClipResult clip = classifyBounds(bounds, guard);
+    if (clip == CLIP_REJECT) return;
+    if (clip == CLIP_PARTIAL) {
+        n = clipPolygon(vertices, n, guard);
+        if (n < 3) return;
+        vertices = clippedVertices.data();
+    }
+    if (recordingActive()) { recordPolygon(vertices, n); return; }
+    fillPolygon(vertices, n, glPointSink, fillScratch, view.y0, view.y1);
+}
+
+void scanlineFill(const vector<pair<int, int>>& vertices, float r, float g, float b, float a) {
+    scanlineFill(vertices.data(), vertices.size(), r, g, b, a);
+}
+
+template <size_t N>
+void scanlineFill(const pair<int, int> (&vertices)[N], float r, float g, float b, float a) {
+    scanlineFill(vertices, N, r, g, b, a);
+}
+
+// ------------------- Filled Midpoint Circle -------------------
+// Same integer decision variable as drawCircle; each step records the
+// widest half-width seen on rows yc +- x and yc +- y, then every row is
+// emitted once as a single span (no overlap, so alpha blends stay correct).
+void fillCircle(int xc, int yc, int r, SpanSink& sink, FillScratch& fs = fillScratch,
+                int clipY0 = INT_MIN, int clipY1 = INT_MAX) {
+    if (r < 0) return;
+    PERF_SCOPE(perfSpanWalk, 2 * r + 1);
+    vector<int>& circleHalfWidth = fs.circleHalfWidth;
+    if (circleHalfWidth.size() < (size_t)r + 1) circleHalfWidth.resize((size_t)r + 1);
+    std::fill(circleHalfWidth.begin(), circleHalfWidth.begin() + r + 1, 0);
+    int x = 0, y = r;
+    int p = 1 - r;
+    while (x <= y) {
+        circleHalfWidth[y] = max(circleHalfWidth[y], x);
+        circleHalfWidth[x] = max(circleHalfWidth[x], y);
+        if (p < 0) p += 2 * x + 3;
+        else { p += 2 * (x - y) + 5; y--; }
+        x++;
+    }
+    sink.begin();
+    for (int y = max(yc - r, clipY0); y <= min(yc + r, clipY1); y++) {
+        int hw = circleHalfWidth[abs(y - yc)];
+        sink.span(y, xc - hw, xc + hw);
+    }
+    sink.end();
+}
+
+void fillCircle(int xc, int yc, int r, float cr, float cg, float cb, float ca) {
+    setColor(cr, cg, cb, ca);
+    transformCircle(xc, yc, r);
+    Rect view = viewportRect();
+    if (classifyBounds({ xc - r, yc - r, xc + r, yc + r }, view) == CLIP_REJECT) return;
+    if (recordingActive()) {
+        recordCommand(CMD_FILL_CIRCLE, xc, yc, r, 0, { xc - r, yc - r, xc + r, yc + r });
+        return;
+    }
+    fillCircle(xc, yc, r, glPointSink, fillScratch, view.y0, view.y1);
+}
+
+// ------------------- Sprite Cache -------------------
+// Shapes drawn many times at different positions (stars, car parts, carts,
+// cabins) are scan-converted once into a run-length coverage mask, one
+// span per run, relative to an anchor point. Every further instance is a
+// blit of those runs: no edge table, just span fills at an offset. A
+// sprite depends only on the shape and the linear part of the model matrix
+// (quantized, so a rotation that comes back hits the same entry); the
+// colour travels with the draw command, so a red and a blue car share one
+// mask. Entries keep the local vertices they were built from and are
+// rebuilt when a caller passes different ones.
+enum SpriteShape : uint8_t {
+    SPRITE_STAR, SPRITE_CAR_BODY, SPRITE_CAR_CABIN, SPRITE_CAR_WINDOW,
+    SPRITE_CART_BASE, SPRITE_CART_BACKREST, SPRITE_CART_BAR, SPRITE_CABIN
+};
+
+struct SpriteRun { int y, x0, x1; };   // relative to the anchor
+struct Sprite {
+    vector<pair<int, int>> shape;      // local vertices it was built from
+    vector<SpriteRun> runs;
+    Rect bounds;                       // of the runs, relative to the anchor
+};
+
+struct SpriteKey {
+    SpriteShape shape;
+    int linear[4];   // matrix a, b, c, d in 1/4096 steps
+    bool operator==(const SpriteKey& o) const {
+        return shape == o.shape && memcmp(linear, o.linear, sizeof(linear)) == 0;
+    }
+};
+struct SpriteKeyHash {
+    size_t operator()(const SpriteKey& k) const {
+        size_t h = k.shape;
+        for (int v : k.linear) h = h * 1000003u ^ (size_t)(unsigned)v;
+        return h;
+    }
+};
+
+bool useSpriteCache = true;
+size_t spriteCacheLimit = 4096;   // entries; the whole cache is dropped past this
+unordered_map<SpriteKey, shared_ptr<const Sprite>, SpriteKeyHash> spriteCache;
+size_t spriteBuilds = 0;
+vector<pair<int, int>> spriteVertices;   // scratch for building a mask, or for drawing without the cache
+
+struct SpriteBuilder : SpanSink {
+    Sprite* sprite = nullptr;
+    void span(int y, int x0, int x1) override {
+        if (x0 > x1) return;
+        Rect& b = sprite->bounds;
+        if (sprite->runs.empty()) b = { x0, y, x1, y };
+        b.x0 = min(b.x0, x0); b.x1 = max(b.x1, x1);
+        b.y0 = min(b.y0, y); b.y1 = max(b.y1, y);
+        sprite->runs.push_back({ y, x0, x1 });
+    }
+};
+
+void blitSprite(const Sprite& sprite, int x, int y, SpanSink& sink, int clipY0 = INT_MIN, int clipY1 = INT_MAX) {
+    PERF_SCOPE(perfSpanWalk, sprite.runs.size());
+    sink.begin();
+    for (const SpriteRun& run : sprite.runs) {
+        int ry = run.y + y;
+        if (ry >= clipY0 && ry <= clipY1) sink.span(ry, run.x0 + x, run.x1 + x);
+    }
+    sink.end();
+}
+
+const Sprite& lookupSprite(SpriteShape id, const pair<int, int>* local, size_t n, shared_ptr<const Sprite>& ref) {
+    const Matrix3& m = modelMatrix;
+    SpriteKey key = { id, { (int)lround(m.a * 4096), (int)lround(m.b * 4096),
+                            (int)lround(m.c * 4096), (int)lround(m.d * 4096) } };
+    auto it = spriteCache.find(key);
+    if (it != spriteCache.end() && it->second->shape.size() == n &&
+        equal(local, local + n, it->second->shape.begin())) {
+        ref = it->second;
+        return *ref;
+    }
+    // build from the quantized matrix so the mask depends on the key alone
+    float a = key.linear[0] / 4096.0f, b = key.linear[1] / 4096.0f;
+    float c = key.linear[2] / 4096.0f, d = key.linear[3] / 4096.0f;
+    spriteVertices.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        float x = (float)local[i].first, y = (float)local[i].second;
+        spriteVertices[i] = { (int)lround(a * x + c * y), (int)lround(b * x + d * y) };
+    }
+    shared_ptr<Sprite> sprite = make_shared<Sprite>();
+    sprite->shape.assign(local, local + n);
+    sprite->bounds = { 0, 0, -1, -1 };
+    SpriteBuilder builder;
+    builder.sprite = sprite.get();
+    fillPolygon(spriteVertices.data(), n, builder);
+    spriteBuilds++;
+    if (spriteCache.size() >= spriteCacheLimit) spriteCache.clear();
+    spriteCache[key] = sprite;
+    ref = sprite;
+    return *ref;
+}
+
+// Fills the polygon `local` (relative to x, y) through the model matrix,
+// like scanlineFill, but from the cached mask.
+void drawSprite(SpriteShape id, const pair<int, int>* local, size_t n, int x, int y,
+                float r, float g, float b, float a) {
+    if (!useSpriteCache) {
+        spriteVertices.resize(n);
+        for (size_t i = 0; i < n; i++) spriteVertices[i] = { local[i].first + x, local[i].second + y };
+        scanlineFill(spriteVertices.data(), n, r, g, b, a);
+        return;
+    }
+    setColor(r, g, b, a);
+    tie(x, y) = modelMatrix.apply(x, y);
+    shared_ptr<const Sprite> ref;
+    const Sprite& sprite = lookupSprite(id, local, n, ref);
+    if (sprite.runs.empty()) return;
+    Rect bounds = { sprite.bounds.x0 + x, sprite.bounds.y0 + y, sprite.bounds.x1 + x, sprite.bounds.y1 + y };
+    Rect view = viewportRect();
+    if (classifyBounds(bounds, view) == CLIP_REJECT) return;
+    if (recordingActive()) {
+        size_t before = recording->commands.size();
+        recordCommand(CMD_SPRITE, (int)recording->sprites.size(), x, y, 0, bounds);
+        if (recording->commands.size() != before) recording->sprites.push_back(move(ref));
+        return;
+    }
+    blitSprite(sprite, x, y, glPointSink, view.y0, view.y1);
+}
+
+template <size_t N>
+void drawSprite(SpriteShape id, const pair<int, int> (&local)[N], int x, int y, float r, float g, float b, float a) {
+    drawSprite(id, local, N, x, y, r, g, b, a);
+}
+
+// ------------------- Tile-Binned Rasterizer -------------------
+// rasterizeCommands() sorts a CommandBuffer into TILE_SIZE x TILE_SIZE
+// screen tiles and rasterizes the tiles on rasterThreads workers (at least
+// one). A tile replays its commands in recording order, clipped to its own
+// rectangle, and no two tiles share a pixel, so the result is the same for
+// any thread count. flushBins() does this for primitives drawn outside
+// recordFrame().
+const int TILE_SIZE = 64;
+
+// Fixed set of workers, each with its own deque of items; an idle worker
+// steals from the back of the others' deques. The calling thread is
+// worker 0, so a pool of one runs everything inline.
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(int workerCount) : queues(max(workerCount, 1)) {
+        for (int w = 1; w < (int)queues.size(); w++) threads.emplace_back(&WorkStealingPool::workerLoop, this, w);
+    }
+
+    ~WorkStealingPool() {
+        { lock_guard<mutex> lock(m); quit = true; }
+        wake.notify_all();
+        for (auto& t : threads) t.join();
+    }
+
+    int size() const { return (int)queues.size(); }
+
+    // Calls fn(item, worker) once per item and returns when all have finished.
+    void run(const vector<int>& items, const function<void(int, int)>& fn) {
+        for (size_t i = 0; i < items.size(); i++) {
+            WorkQueue& q = queues[i % queues.size()];
+            lock_guard<mutex> lock(q.m);
+            q.items.push_back(items[i]);
+        }
+        {
+            lock_guard<mutex> lock(m);
+            job = &fn;
+            busy = (int)threads.size();
+            generation++;
+        }
+        wake.notify_all();
+        drain(0);
+        unique_lock<mutex> lock(m);
+        done.wait(lock, [this] { return busy == 0; });
+        job = nullptr;
+    }
+
+private:
+    struct WorkQueue { mutex m; deque<int> items; };
+    vector<WorkQueue> queues;
+    vector<thread> threads;
+    mutex m;
+    condition_variable wake, done;
+    const function<void(int, int)>* job = nullptr;
+    uint64_t generation = 0;
+    int busy = 0;
+    bool quit = false;
+
+    bool pop(int w, int& item) {
+        {
+            WorkQueue& own = queues[w];
+            lock_guard<mutex> lock(own.m);
+            if (!own.items.empty()) { item = own.items.front(); own.items.pop_front(); return true; }
+        }
+        for (size_t k = 1; k < queues.size(); k++) {
+            WorkQueue& victim = queues[(w + k) % queues.size()];
+            lock_guard<mutex> lock(victim.m);
+            if (!victim.items.empty()) { item = victim.items.back(); victim.items.pop_back(); return true; }
+        }
+        return false;
+    }
+
+    void drain(int w) {
+        int item;
+        while (pop(w, item)) (*job)(item, w);
+    }
+
+    void workerLoop(int w) {
+        traceThreadName(("raster worker " + to_string(w)).c_str());
+        uint64_t seen = 0;
+        for (;;) {
+            {
+                unique_lock<mutex> lock(m);
+                wake.wait(lock, [&] { return quit || generation != seen; });
+                if (quit) return;
+                seen = generation;
+            }
+            drain(w);
+            lock_guard<mutex> lock(m);
+            if (--busy == 0) done.notify_one();
+        }
+    }
+};
+
+// Writes spans and pixels of one command, clipped to one tile.
+struct TileSink : SpanSink {
+    Rect clip = { 0, 0, -1, -1 };
+    uint32_t color = 0;
+    BlendMode mode = BLEND_OVER;
+
+    void span(int y, int x0, int x1) override {
+        if (y < clip.y0 || y > clip.y1) return;
+        x0 = max(x0, clip.x0); x1 = min(x1, clip.x1);
+        if (x0 > x1) return;
+        PERF_SCOPE(perfBlend, x1 - x0 + 1);
+        blendSpan(frame.row(y) + x0, x1 - x0 + 1, color, mode);
+    }
+    void pixel(int x, int y) {
+        if (x < clip.x0 || x > clip.x1 || y < clip.y0 || y > clip.y1) return;
+        blendPixel(frame.row(y)[x], color, mode);
+    }
+};
+
+struct TileWorker {
+    TileSink sink;
+    FillScratch scratch;
+};
+
+unique_ptr<WorkStealingPool> rasterPool;
+vector<TileWorker> tileWorkers;
+vector<vector<uint32_t>> tileBins;   // command indices per tile, in recording order
+vector<int> busyTiles;
+int tilesX = 0;
+
+WorkStealingPool& workerPool() {
+    if (!rasterPool || rasterPool->size() != max(rasterThreads, 1)) {
+        rasterPool.reset(new WorkStealingPool(rasterThreads));
+        tileWorkers.resize(rasterPool->size());
+    }
+    return *rasterPool;
+}
+
+// Rasterizes one command clipped to sink.clip. Sink is TileSink, or any
+// sink with the same members (GLBatchSink).
+template <class Sink>
+void rasterCommand(const CommandBuffer& cb, const DrawCommand& c, Sink& sink, FillScratch& scratch) {
+    sink.color = c.color;
+    sink.mode = c.blend;
+    auto plot = [&sink](int x, int y) { sink.pixel(x, y); };
+    int lo = strokeLow(c.width), w = c.width;
+    auto stamp = [&sink, lo, w](int x, int y) {
+        for (int sy = y - lo; sy < y - lo + w; sy++) sink.span(sy, x - lo, x - lo + w - 1);
+    };
+    switch (c.type) {
+    case CMD_LINE:
+        if (w == 1) rasterLine(c.a, c.b, c.c, c.d, plot);
+        else rasterLine(c.a, c.b, c.c, c.d, stamp);
+        break;
+    case CMD_CIRCLE:
+        if (w == 1) rasterCircle(c.a, c.b, c.c, plot);
+        else rasterCircle(c.a, c.b, c.c, stamp);
+        break;
+    case CMD_FILL_CIRCLE: fillCircle(c.a, c.b, c.c, sink, scratch, sink.clip.y0, sink.clip.y1); break;
+    case CMD_POLYGON: fillPolygon(&cb.vertices[c.a], (size_t)c.b, sink, scratch, sink.clip.y0, sink.clip.y1); break;
+    case CMD_SPRITE: blitSprite(*cb.sprites[c.a], c.b, c.c, sink, sink.clip.y0, sink.clip.y1); break;
+    case CMD_SPARKS: break;   // drawn by rasterizeCommands
+    }
+}
+
+void rasterCommand(const CommandBuffer& cb, const DrawCommand& c, TileWorker& tw) {
+    rasterCommand(cb, c, tw.sink, tw.scratch);
+}
+
+void rasterTile(const CommandBuffer& cb, int tile, TileWorker& tw) {
+    TRACE_FUNCTION();
+    int tx = tile % tilesX, ty = tile / tilesX;
+    const Rect& view = deviceViewport;
+    tw.sink.clip = { max(tx * TILE_SIZE, view.x0), max(ty * TILE_SIZE, view.y0),
+                     min((tx + 1) * TILE_SIZE - 1, view.x1), min((ty + 1) * TILE_SIZE - 1, view.y1) };
+    for (uint32_t idx : tileBins[tile]) rasterCommand(cb, cb.commands[idx], tw);
+}
+
+// Bins commands [begin, end) of cb and rasterizes the busy tiles. With a
+// single worker there is nothing to balance, so the commands are drawn in
+// order with the whole viewport as the clip, which saves re-walking a large
+// polygon's edges once per tile.
+void rasterizeRange(const CommandBuffer& cb, uint32_t begin, uint32_t end) {
+    if (begin == end) return;
+    if (rasterThreads <= 1) {
+        if (tileWorkers.empty()) tileWorkers.resize(1);
+        TileWorker& tw = tileWorkers[0];
+        tw.sink.clip = deviceViewport;
+        for (uint32_t i = begin; i < end; i++) rasterCommand(cb, cb.commands[i], tw);
+        return;
+    }
+    tilesX = (frame.width + TILE_SIZE - 1) / TILE_SIZE;
+    int tilesY = (frame.height + TILE_SIZE - 1) / TILE_SIZE;
+    tileBins.resize((size_t)tilesX * tilesY);
+    for (auto& bin : tileBins) bin.clear();
+    for (uint32_t i = begin; i < end; i++) {
+        const Rect& b = cb.commands[i].bounds;
+        for (int ty = b.y0 / TILE_SIZE; ty <= b.y1 / TILE_SIZE; ty++)
+            for (int tx = b.x0 / TILE_SIZE; tx <= b.x1 / TILE_SIZE; tx++)
+                tileBins[(size_t)ty * tilesX + tx].push_back(i);
+    }
+    busyTiles.clear();
+    for (size_t t = 0; t < tileBins.size(); t++)
+        if (!tileBins[t].empty()) busyTiles.push_back((int)t);
+
+    workerPool().run(busyTiles, [&cb](int tile, int worker) { rasterTile(cb, tile, tileWorkers[worker]); });
+}
+
+// Sparks are spread over the whole sky, so binning them would make every
+// tile scan all of them; they are drawn serially between the command runs
+// around them instead (drawFireworks already dropped off-screen ones).
+// c.c is the spark side in device pixels.
+void drawSparks(const CommandBuffer& cb, const DrawCommand& c) {
+    TRACE_FUNCTION();
+    int size = c.c;
+    PERF_SCOPE(perfBlend, (uint64_t)c.b * size * size);
+    for (int i = c.a; i < c.a + c.b; i++) {
+        const Spark& s = cb.sparks[i];
+        if (size == 2) {
+            uint32_t* p = frame.row(s.y) + s.x;
+            p[0] = addSaturate(p[0], s.add); p[1] = addSaturate(p[1], s.add);
+            p += frame.width;
+            p[0] = addSaturate(p[0], s.add); p[1] = addSaturate(p[1], s.add);
+            continue;
+        }
+        for (int y = s.y; y < s.y + size; y++) blendSpan(frame.row(y) + s.x, size, s.add, BLEND_ADD);
+    }
+}
+
+void rasterizeCommands(const CommandBuffer& cb) {
+    TRACE_FUNCTION();
+    if (cb.hasClear) {
+        // the bars outside the viewport stay black from setOutputSize
+        const Rect& view = deviceViewport;
+        if (view.x0 == 0 && view.y0 == 0 && view.x1 == frame.width - 1 && view.y1 == frame.height - 1)
+            frame.clear(cb.clearColor);
+        else
+            for (int y = view.y0; y <= view.y1; y++)
+                std::fill(frame.row(y) + view.x0, frame.row(y) + view.x1 + 1, cb.clearColor);
+    }
+    uint32_t begin = 0, n = (uint32_t)cb.commands.size();
+    for (uint32_t i = 0; i < n; i++) {
+        if (cb.commands[i].type != CMD_SPARKS) continue;
+        rasterizeRange(cb, begin, i);
+        drawSparks(cb, cb.commands[i]);
+        begin = i + 1;
+    }
+    rasterizeRange(cb, begin, n);
+}
+
+void flushBins() {
+    rasterizeCommands(immediateCommands);
+    immediateCommands.clear();
+}
+
+// ------------------- Supersampling -------------------
+// With --supersample=N the frame is rendered at N times the output size on
+// each axis and averaged down here with an N x N box filter, per channel
+// and rounded. Red/blue and green/alpha are summed two at a time in 16-bit
+// lanes (N is at most 8, so a lane holds at most 64 * 255). Bands of rows
+// go to the raster workers.
+const int RESOLVE_BAND = 16;   // output rows per work item
+vector<int> resolveBands;
+
+// N is a template parameter so the block loops unroll for the common sizes.
+template <int N>
+void resolveRows(int oy0, int oy1) {
+    const int n = N;
+    int w = outputFrame.width;
+    uint32_t area = (uint32_t)(n * n), half = (area / 2) * 0x00010001u;
+    int shift = (area & (area - 1)) == 0 ? __builtin_ctz(area) : -1;
+    const uint32_t* rows[N];
+    for (int oy = oy0; oy < oy1; oy++) {
+        for (int k = 0; k < n; k++) rows[k] = frame.row(oy * n + k);
+        uint32_t* dst = outputFrame.row(oy);
+        for (int ox = 0; ox < w; ox++) {
+            uint32_t rb = half, ga = half;
+            for (int k = 0; k < n; k++) {
+                const uint32_t* src = rows[k] + ox * n;
+                for (int j = 0; j < n; j++) {
+                    rb += src[j] & 0x00FF00FFu;
+                    ga += (src[j] >> 8) & 0x00FF00FFu;
+                }
+            }
+            if (shift >= 0) {
+                rb = (rb >> shift) & 0x00FF00FFu;
+                ga = (ga >> shift) & 0x00FF00FFu;
+            }
+            else {
+                rb = ((rb & 0xFFFF) / area) | (((rb >> 16) / area) << 16);
+                ga = ((ga & 0xFFFF) / area) | (((ga >> 16) / area) << 16);
+            }
+            dst[ox] = rb | (ga << 8);
+        }
+    }
+}
+
+#ifdef PARK_X86_SIMD
+// 2x2 with SSE2, two output pixels per step: the two source rows are
+// widened to 16-bit channels and added, then the horizontal pairs.
+__attribute__((target("sse2"))) void resolveRows2x2SSE2(int oy0, int oy1) {
+    int w = outputFrame.width;
+    __m128i zero = _mm_setzero_si128(), two = _mm_set1_epi16(2);
+    for (int oy = oy0; oy < oy1; oy++) {
+        const uint32_t* r0 = frame.row(oy * 2);
+        const uint32_t* r1 = frame.row(oy * 2 + 1);
+        uint32_t* dst = outputFrame.row(oy);
+        int ox = 0;
+        for (; ox + 2 <= w; ox += 2) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(r0 + ox * 2));
+            __m128i b = _mm_loadu_si128((const __m128i*)(r1 + ox * 2));
+            __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+            __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+            lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+            hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+            __m128i sum = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(lo, hi), two), 2);
+            _mm_storel_epi64((__m128i*)(dst + ox), _mm_packus_epi16(sum, sum));
+        }
+        if (ox < w) {
+            uint32_t rb = 0x00020002u, ga = 0x00020002u;
+            for (uint32_t p : { r0[ox * 2], r0[ox * 2 + 1], r1[ox * 2], r1[ox * 2 + 1] }) {
+                rb += p & 0x00FF00FFu;
+                ga += (p >> 8) & 0x00FF00FFu;
+            }
+            dst[ox] = ((rb >> 2) & 0x00FF00FFu) | (((ga >> 2) & 0x00FF00FFu) << 8);
         }
-        for (auto& e : AET) e.x += e.inv_m;
     }
-    glEnd();
 }
+#endif
+
+void resolveRows(int oy0, int oy1) {
+#ifdef PARK_X86_SIMD
+    if (supersample == 2 && spanKernels != &scalarKernels) { resolveRows2x2SSE2(oy0, oy1); return; }
+#endif
+    switch (supersample) {
+    case 2: resolveRows<2>(oy0, oy1); break;
+    case 3: resolveRows<3>(oy0, oy1); break;
+    case 4: resolveRows<4>(oy0, oy1); break;
+    case 5: resolveRows<5>(oy0, oy1); break;
+    case 6: resolveRows<6>(oy0, oy1); break;
+    case 7: resolveRows<7>(oy0, oy1); break;
+    default: resolveRows<8>(oy0, oy1); break;
+    }
+}
+
+void resolveFrame() {
+    TRACE_FUNCTION();
+    if (supersample <= 1) return;
+    int h = outputFrame.height;
+    if (rasterThreads <= 1) {
+        resolveRows(0, h);
+        return;
+    }
+    resolveBands.clear();
+    for (int y = 0; y < h; y += RESOLVE_BAND) resolveBands.push_back(y);
+    workerPool().run(resolveBands, [h](int y, int) { resolveRows(y, min(y + RESOLVE_BAND, h)); });
+}
+
+// ------------------- GL Batched Submission -------------------
+// The GL window without one glBegin/glEnd per pixel or span: the recorded
+// frame is replayed into one client-side vertex array, every span and
+// pixel becoming a GL_LINES segment across the pixel centres of its row,
+// with the colour as a per-vertex attribute. GL draws the primitives of a
+// glDrawArrays in array order, so the whole frame keeps its painter's
+// order in a single draw. A new draw only starts where the blend function
+// changes and for the firework sparks (GL_POINTS of sparkSize), which
+// leaves a few draw calls per frame.
+struct BatchVertex { float x, y; uint32_t color; };   // colour in R,G,B,A byte order
+struct BatchRun { GLenum primitive; BlendMode blend; bool premultiplied; int first, count; };
+
+vector<BatchVertex> batchVertices;
+vector<BatchRun> batchRuns;
+
+struct GLBatchSink : SpanSink {
+    Rect clip = { 0, 0, -1, -1 };
+    uint32_t color = 0;
+    BlendMode mode = BLEND_OVER;
+
+    void span(int y, int x0, int x1) override {
+        if (y < clip.y0 || y > clip.y1) return;
+        x0 = max(x0, clip.x0); x1 = min(x1, clip.x1);
+        if (x0 > x1) return;
+        // pixel x spans [x, x + 1); the 3/8 nudge keeps the segment ends off
+        // pixel boundaries, where the diamond-exit rule may pick either side
+        batchVertices.push_back({ x0 + 0.375f, y + 0.5f, color });
+        batchVertices.push_back({ x1 + 1.375f, y + 0.5f, color });
+    }
+    void pixel(int x, int y) { span(y, x, x); }
+};
+GLBatchSink batchSink;
+
+// Starts a new run unless the last one already draws this way.
+void batchRun(GLenum primitive, BlendMode blend, bool premultiplied) {
+    int end = (int)batchVertices.size();
+    if (!batchRuns.empty()) {
+        BatchRun& last = batchRuns.back();
+        if (last.primitive == primitive && last.blend == blend && last.premultiplied == premultiplied) return;
+        last.count = end - last.first;
+    }
+    batchRuns.push_back({ primitive, blend, premultiplied, end, 0 });
+}
+
+void submitBatched(const CommandBuffer& cb) {
+    TRACE_FUNCTION();
+    if (cb.hasClear)
+        glClearViewport((cb.clearColor & 0xFF) / 255.0f, ((cb.clearColor >> 8) & 0xFF) / 255.0f,
+                        ((cb.clearColor >> 16) & 0xFF) / 255.0f);
+    batchVertices.clear();
+    batchRuns.clear();
+    GLBatchSink& sink = batchSink;
+    sink.clip = deviceViewport;
+    for (const DrawCommand& c : cb.commands) {
+        if (c.type == CMD_SPARKS) {
+            batchRun(GL_POINTS, BLEND_ADD, true);
+            float half = c.c * 0.5f;
+            for (int i = c.a; i < c.a + c.b; i++) {
+                const Spark& sp = cb.sparks[i];
+                batchVertices.push_back({ sp.x + half, sp.y + half, sp.add });
+            }
+            continue;
+        }
+        batchRun(GL_LINES, c.blend, false);
+        rasterCommand(cb, c, sink, fillScratch);
+    }
+    if (batchRuns.empty()) return;
+    batchRuns.back().count = (int)batchVertices.size() - batchRuns.back().first;
+
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glVertexPointer(2, GL_FLOAT, sizeof(BatchVertex), &batchVertices[0].x);
+    glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(BatchVertex), &batchVertices[0].color);
+    for (const BatchRun& run : batchRuns) {
+        if (run.count == 0) continue;
+        // sparks carry premultiplied colour and add, like drawSparks
+        if (run.premultiplied) glBlendFunc(GL_ONE, GL_ONE);
+        else glBlendFunc(GL_SRC_ALPHA, run.blend == BLEND_ADD ? GL_ONE : GL_ONE_MINUS_SRC_ALPHA);
+        if (run.primitive == GL_POINTS) glPointSize((float)sparkSize);
+        glDrawArrays(run.primitive, run.first, run.count);
+        glDrawCalls++;
+        if (run.primitive == GL_POINTS) glPointSize(1.0f);
+    }
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+}
+
+// ------------------- Trig Tables -------------------
+// Whole-degree sin/cos for the angle-based geometry (sun rays, spokes).
+struct TrigTable {
+    double s[360], c[360];
+    TrigTable() {
+        for (int a = 0; a < 360; a++) { s[a] = sin(a * M_PI / 180); c[a] = cos(a * M_PI / 180); }
+    }
+};
+const TrigTable trig;
+
+inline double sinDeg(int a) { a %= 360; return trig.s[a < 0 ? a + 360 : a]; }
+inline double cosDeg(int a) { a %= 360; return trig.c[a < 0 ? a + 360 : a]; }
 
 // ------------------- Scene Elements -------------------
 void drawGround() {
-    vector<pair<int, int>> g = { {0,0},{900,0},{900,150},{0,150} };
+    TRACE_FUNCTION();
+    const pair<int, int> g[] = { {0,0},{900,0},{900,150},{0,150} };
     scanlineFill(g, 0.3f, 0.8f, 0.3f, 1.0f);
 }
 
 void drawRoad() {
-    vector<pair<int, int>> r = { {0,60},{900,60},{900,120},{0,120} };
+    TRACE_FUNCTION();
+    const pair<int, int> r[] = { {0,60},{900,60},{900,120},{0,120} };
     scanlineFill(r, 0.2f, 0.2f, 0.2f, 1.0f);
     for (int i = 0; i < 9; i++) {
-        vector<pair<int, int>> dash = { {50 + i * 100,85},{90 + i * 100,85},{90 + i * 100,95},{50 + i * 100,95} };
+        const pair<int, int> dash[] = { {50 + i * 100,85},{90 + i * 100,85},{90 + i * 100,95},{50 + i * 100,95} };
         scanlineFill(dash, 1, 1, 1, 1.0f);
     }
 }
 
 void drawTree(int x, int y) {
-    vector<pair<int, int>> trunk = { {x,y},{x + 20,y},{x + 20,y + 60},{x,y + 60} };
+    TRACE_FUNCTION();
+    const pair<int, int> trunk[] = { {x,y},{x + 20,y},{x + 20,y + 60},{x,y + 60} };
     scanlineFill(trunk, 0.5f, 0.25f, 0.0f, 1.0f);
-    vector<pair<int, int>> crown1 = { {x - 30,y + 60},{x + 50,y + 60},{x + 10,y + 120} };
-    vector<pair<int, int>> crown2 = { {x - 25,y + 100},{x + 45,y + 100},{x + 10,y + 160} };
+    const pair<int, int> crown1[] = { {x - 30,y + 60},{x + 50,y + 60},{x + 10,y + 120} };
+    const pair<int, int> crown2[] = { {x - 25,y + 100},{x + 45,y + 100},{x + 10,y + 160} };
     scanlineFill(crown1, 0.0f, 0.7f, 0.0f, 1.0f);
     scanlineFill(crown2, 0.0f, 0.7f, 0.0f, 1.0f);
 }
 
 void drawSun() {
+    TRACE_FUNCTION();
     int cx = (int)round(sunX), cy = 600, r = 40;
     drawCircle(cx, cy, r);
-    vector<pair<int, int>> sunPoly;
-    for (int a = 0; a < 360; a++) sunPoly.push_back({ cx + (int)(r * cos(a * M_PI / 180)), cy + (int)(r * sin(a * M_PI / 180)) });
-    scanlineFill(sunPoly, 1, 1, 0, 1.0f);
+    fillCircle(cx, cy, r, 1, 1, 0, 1.0f);
     for (int i = 0; i < 360; i += 30) {
-        int x1 = cx + 60 * cos(i * M_PI / 180), y1 = cy + 60 * sin(i * M_PI / 180);
+        int x1 = cx + 60 * cosDeg(i), y1 = cy + 60 * sinDeg(i);
         drawLine(cx, cy, x1, y1);
     }
 }
 
 void drawMoon() {
+    TRACE_FUNCTION();
     int cx = 80, cy = 600, r = 30;
-    vector<pair<int, int>> moonPoly;
-    for (int a = 0; a < 360; a++) moonPoly.push_back({ cx + (int)(r * cos(a * M_PI / 180)), cy + (int)(r * sin(a * M_PI / 180)) });
-    scanlineFill(moonPoly, 0.95f, 0.95f, 1.0f, 1.0f);
+    fillCircle(cx, cy, r, 0.95f, 0.95f, 1.0f, 1.0f);
 }
 
 void drawStar(int x, int y) {
-    vector<pair<int, int>> star = { {x,y},{x + 2,y + 6},{x + 6,y + 2},{x - 2,y + 2},{x + 4,y + 8} };
-    scanlineFill(star, 1, 1, 1, 1.0f);
+    const pair<int, int> star[] = { {0,0},{2,6},{6,2},{-2,2},{4,8} };
+    drawSprite(SPRITE_STAR, star, x, y, 1, 1, 1, 1.0f);
 }
 
 void drawCloud(int cx, int cy) {
+    TRACE_FUNCTION();
     int rads[5] = { 20,30,25,20,25 };
     int off[5][2] = { {0,0},{30,10},{-30,10},{20,-10},{-20,-10} };
     for (int i = 0; i < 5; i++) {
         drawCircle(cx + off[i][0], cy + off[i][1], rads[i]);
-        vector<pair<int, int>> poly;
-        for (int a = 0; a < 360; a++) poly.push_back({ cx + off[i][0] + (int)(rads[i] * cos(a * M_PI / 180)), cy + off[i][1] + (int)(rads[i] * sin(a * M_PI / 180)) });
-        scanlineFill(poly, 1, 1, 1, 1.0f);
+        fillCircle(cx + off[i][0], cy + off[i][1], rads[i], 1, 1, 1, 1.0f);
     }
 }
 
 void drawTent() {
-    vector<pair<int, int>> base = { {100,150},{300,150},{300,250},{100,250} };
+    TRACE_FUNCTION();
+    const pair<int, int> base[] = { {100,150},{300,150},{300,250},{100,250} };
     scanlineFill(base, 1, 0.5f, 0.5f, 1.0f);
-    vector<pair<int, int>> roof = { {80,250},{320,250},{200,380} };
+    const pair<int, int> roof[] = { {80,250},{320,250},{200,380} };
     scanlineFill(roof, 0.9f, 0.1f, 0.1f, 1.0f);
-    vector<pair<int, int>> door = { {180,150},{220,150},{220,210},{180,210} };
+    const pair<int, int> door[] = { {180,150},{220,150},{220,210},{180,210} };
     scanlineFill(door, 0.2f, 0.2f, 0.2f, 1.0f);
 
     // pole
-    vector<pair<int, int>> pole = { {198,380},{202,380},{202,430},{198,430} };
+    const pair<int, int> pole[] = { {198,380},{202,380},{202,430},{198,430} };
     scanlineFill(pole, 0.3f, 0.3f, 0.3f, 1.0f);
+}
 
+void drawTentFlag(float time) {
+    TRACE_FUNCTION();
     // waving circus flag
-    float shear = 0.3f * sin(flagTime); // sinusoidal shear
-    glPushMatrix();
-    glTranslatef(202, 430, 0);
-    GLfloat shearMat[16] = {
-        1, shear, 0, 0,
-        0, 1,      0, 0,
-        0, 0,      1, 0,
-        0, 0,      0, 1
-    };
-    glMultMatrixf(shearMat);
-    glTranslatef(-202, -430, 0);
+    float shear = 0.3f * sin(time); // sinusoidal shear
+    custom_push_matrix();
+    custom_translate(202, 430);
+    custom_shear(0, shear);
+    custom_translate(-202, -430);
 
-    vector<pair<int, int>> flag = { {202,430},{240,420},{202,410} };
+    const pair<int, int> flag[] = { {202,430},{240,420},{202,410} };
     scanlineFill(flag, 1, 1, 0, 1.0f);
-    glPopMatrix();
+    custom_pop_matrix();
 }
 
 void drawHouse() {
-    vector<pair<int, int>> base = { {400,150},{600,150},{600,250},{400,250} };
+    TRACE_FUNCTION();
+    const pair<int, int> base[] = { {400,150},{600,150},{600,250},{400,250} };
     scanlineFill(base, 0.6f, 0.4f, 0.2f, 1.0f);
-    vector<pair<int, int>> roof = { {380,250},{620,250},{500,350} };
+    const pair<int, int> roof[] = { {380,250},{620,250},{500,350} };
     scanlineFill(roof, 0.7f, 0, 0, 1.0f);
-    vector<pair<int, int>> door = { {480,150},{520,150},{520,200},{480,200} };
+    const pair<int, int> door[] = { {480,150},{520,150},{520,200},{480,200} };
     scanlineFill(door, 0.2f, 0.2f, 0.2f, 1.0f);
 
     // pole
-    vector<pair<int, int>> pole = { {498,350},{502,350},{502,430},{498,430} };
+    const pair<int, int> pole[] = { {498,350},{502,350},{502,430},{498,430} };
     scanlineFill(pole, 0.3f, 0.3f, 0.3f, 1.0f);
+}
 
+void drawHouseFlag(float time) {
+    TRACE_FUNCTION();
     // waving house flag
-    float shear = 0.3f * sin(flagTime + 1.5f); // phase shift so flags differ
-    glPushMatrix();
-    glTranslatef(502, 430, 0);
-    GLfloat shearMat[16] = {
-        1, shear, 0, 0,
-        0, 1,      0, 0,
-        0, 0,      1, 0,
-        0, 0,      0, 1
-    };
-    glMultMatrixf(shearMat);
-    glTranslatef(-502, -430, 0);
+    float shear = 0.3f * sin(time + 1.5f); // phase shift so flags differ
+    custom_push_matrix();
+    custom_translate(502, 430);
+    custom_shear(0, shear);
+    custom_translate(-502, -430);
 
-    vector<pair<int, int>> flag = { {502,430},{540,420},{502,410} };
+    const pair<int, int> flag[] = { {502,430},{540,420},{502,410} };
     scanlineFill(flag, 1, 1, 0, 1.0f);
-    glPopMatrix();
+    custom_pop_matrix();
 }
 
 
 void drawWheel(int cx, int cy, int r) {
-    vector<pair<int, int>> tyre;
-    for (int a = 0; a < 360; a++) tyre.push_back({ cx + (int)(r * cos(a * M_PI / 180)), cy + (int)(r * sin(a * M_PI / 180)) });
-    scanlineFill(tyre, 0, 0, 0, 1.0f);
-    vector<pair<int, int>> hub;
-    for (int a = 0; a < 360; a++) hub.push_back({ cx + (int)(r / 3 * cos(a * M_PI / 180)), cy + (int)(r / 3 * sin(a * M_PI / 180)) });
-    scanlineFill(hub, 0.7f, 0.7f, 0.7f, 1.0f);
-
-    glPushMatrix();
-    glTranslatef((float)cx, (float)cy, 0.0f);
-    glRotatef(wheelAngle, 0, 0, 1);
-    glTranslatef(-(float)cx, -(float)cy, 0.0f);
+    fillCircle(cx, cy, r, 0, 0, 0, 1.0f);
+    fillCircle(cx, cy, r / 3, 0.7f, 0.7f, 0.7f, 1.0f);
+
+    custom_push_matrix();
+    custom_translate((float)cx, (float)cy);
+    custom_rotate(wheelAngle);
+    custom_translate(-(float)cx, -(float)cy);
     drawLine(cx - r, cy, cx + r, cy);
     drawLine(cx, cy - r, cx, cy + r);
-    glPopMatrix();
+    custom_pop_matrix();
 }
 
 void drawCar(float x, int color) {
-    glPushMatrix();
-    glTranslatef(x, 0, 0);
-    if (color == 0) scanlineFill({ {100,120},{220,120},{220,180},{100,180} }, 1, 0, 0, 1.0f);
-    else scanlineFill({ {100,120},{220,120},{220,180},{100,180} }, 0, 0, 1, 1.0f);
-    scanlineFill({ {120,180},{200,180},{180,210},{140,210} }, 0.8f, 0.2f, 0.2f, 1.0f);
-    scanlineFill({ {145,185},{175,185},{170,205},{150,205} }, 0.2f, 0.6f, 1.0f, 1.0f);
-    drawWheel(140, 105, 15);
-    drawWheel(180, 105, 15);
-    glPopMatrix();
-}
-
-void drawFerrisWheel() {
+    TRACE_FUNCTION();
+    // offset applied to the vertices so the framebuffer target moves the car too
+    int dx = (int)round(x);
+    const pair<int, int> body[] = { {0,0},{120,0},{120,60},{0,60} };
+    if (color == 0) drawSprite(SPRITE_CAR_BODY, body, dx + 100, 120, 1, 0, 0, 1.0f);
+    else drawSprite(SPRITE_CAR_BODY, body, dx + 100, 120, 0, 0, 1, 1.0f);
+    const pair<int, int> cabin[] = { {20,60},{100,60},{80,90},{40,90} };
+    drawSprite(SPRITE_CAR_CABIN, cabin, dx + 100, 120, 0.8f, 0.2f, 0.2f, 1.0f);
+    const pair<int, int> window[] = { {45,65},{75,65},{70,85},{50,85} };
+    drawSprite(SPRITE_CAR_WINDOW, window, dx + 100, 120, 0.2f, 0.6f, 1.0f, 1.0f);
+    drawWheel(dx + 140, 105, 15);
+    drawWheel(dx + 180, 105, 15);
+}
+
+// rim and stands; the rotating spokes and cabins are drawn by drawFerrisWheel
+void drawFerrisWheelFrame() {
     int cx = 700, cy = 300, r = 100;
     drawCircle(cx, cy, r);
-    vector<pair<int, int>> stand1 = { {cx - 120,150},{cx - 60,150},{cx,cy - 30} };
-    vector<pair<int, int>> stand2 = { {cx + 120,150},{cx + 60,150},{cx,cy - 30} };
+    const pair<int, int> stand1[] = { {cx - 120,150},{cx - 60,150},{cx,cy - 30} };
+    const pair<int, int> stand2[] = { {cx + 120,150},{cx + 60,150},{cx,cy - 30} };
     scanlineFill(stand1, 0.5f, 0.5f, 0.5f, 1.0f);
     scanlineFill(stand2, 0.5f, 0.5f, 0.5f, 1.0f);
+}
 
-    glPushMatrix();
-    glTranslatef((float)cx, (float)cy, 0.0f);
-    glRotatef(wheelAngle, 0, 0, 1);
-    glTranslatef(-(float)cx, -(float)cy, 0.0f);
+void drawFerrisWheel(float angle) {
+    TRACE_FUNCTION();
+    int cx = 700, cy = 300, r = 100;
+    custom_push_matrix();
+    custom_translate((float)cx, (float)cy);
+    custom_rotate(angle);
+    custom_translate(-(float)cx, -(float)cy);
     for (int a = 0; a < 360; a += 45) {
-        int x1 = cx + (int)(r * cos(a * M_PI / 180)), y1 = cy + (int)(r * sin(a * M_PI / 180));
+        int x1 = cx + (int)(r * cosDeg(a)), y1 = cy + (int)(r * sinDeg(a));
         drawLine(cx, cy, x1, y1);
-        vector<pair<int, int>> cab = { {x1 - 10,y1 - 10},{x1 + 10,y1 - 10},{x1 + 10,y1 + 10},{x1 - 10,y1 + 10} };
-        scanlineFill(cab, 1, 0.5f, 0, 1.0f);
+        const pair<int, int> cab[] = { {-10,-10},{10,-10},{10,10},{-10,10} };
+        drawSprite(SPRITE_CABIN, cab, x1, y1, 1, 0.5f, 0, 1.0f);
     }
-    glPopMatrix();
+    custom_pop_matrix();
 }
 
 void drawBird(int x, int y) {
+    TRACE_FUNCTION();
     int wing = (int)(15 * sin(wingAngle * M_PI / 180));
-    glColor3f(0, 0, 0);
+    setColor(0, 0, 0);
     drawLine(x, y, x - 20, y + wing);
     drawLine(x, y, x + 20, y + wing);
 }
 
 // ------------------- Roller coaster -------------------
-vector<pair<int, int>> coasterTrack = {
+const pair<int, int> builtinCoasterTrack[] = {
     {50,200},
     {150,300},
     {300,500},
@@ -300,9 +1639,11 @@ vector<pair<int, int>> coasterTrack = {
     {600,180},
     {800,250}
 };
+vector<pair<int, int>> coasterTrack(begin(builtinCoasterTrack), end(builtinCoasterTrack));
 
 void drawCoasterTrack() {
-    glColor3f(0, 0, 0);
+    TRACE_FUNCTION();
+    setColor(0, 0, 0);
     // Draw track lines
     for (size_t i = 0; i < coasterTrack.size() - 1; i++) {
         drawLine(coasterTrack[i].first, coasterTrack[i].second,
@@ -333,6 +1674,7 @@ pair<int, int> getCartPos(float t) {
 
 // ------------------- Roller coaster -------------------
 void drawCartTrain() {
+    TRACE_FUNCTION();
     int numCarts = 5;      // number of connected carts
     float cartSpacing = 45; // distance between carts
     for (int i = 0; i < numCarts; i++) {
@@ -348,104 +1690,616 @@ void drawCartTrain() {
         int cy = (int)round((1 - localT) * y0 + localT * y1);
         // Slope angle for tilt
         float angle = atan2(y1 - y0, x1 - x0) * 180.0f / M_PI;
-        glPushMatrix();
-        glTranslatef((float)cx, (float)cy, 0.0f);
-        glRotatef(angle, 0, 0, 1); // tilt cart according to slope
-        glTranslatef(-(float)cx, -(float)cy, 0.0f);
+        custom_push_matrix();
+        custom_translate((float)cx, (float)cy);
+        custom_rotate(angle); // tilt cart according to slope
+        custom_translate(-(float)cx, -(float)cy);
         // Base cart rectangle
-        vector<pair<int, int>> cartBase = {
-            {cx - 20, cy + 6},
-            {cx + 20, cy + 6},
-            {cx + 20, cy + 26},
-            {cx - 20, cy + 26}
+        const pair<int, int> cartBase[] = {
+            {-20, 6},
+            {20, 6},
+            {20, 26},
+            {-20, 26}
         };
-        scanlineFill(cartBase, 0.8f, 0.0f, 0.0f, 1.0f);
+        drawSprite(SPRITE_CART_BASE, cartBase, cx, cy, 0.8f, 0.0f, 0.0f, 1.0f);
         // Backrest
-        vector<pair<int, int>> backrest = {
-            {cx - 20, cy + 26},
-            {cx + 20, cy + 26},
-            {cx + 15, cy + 40},
-            {cx - 15, cy + 40}
+        const pair<int, int> backrest[] = {
+            {-20, 26},
+            {20, 26},
+            {15, 40},
+            {-15, 40}
         };
-        scanlineFill(backrest, 0.6f, 0.0f, 0.0f, 1.0f);
+        drawSprite(SPRITE_CART_BACKREST, backrest, cx, cy, 0.6f, 0.0f, 0.0f, 1.0f);
         // Safety bar
-        vector<pair<int, int>> bar = {
-            {cx - 18, cy + 18},
-            {cx + 18, cy + 18},
-            {cx + 18, cy + 22},
-            {cx - 18, cy + 22}
+        const pair<int, int> bar[] = {
+            {-18, 18},
+            {18, 18},
+            {18, 22},
+            {-18, 22}
         };
-        scanlineFill(bar, 0.2f, 0.2f, 0.2f, 1.0f);
+        drawSprite(SPRITE_CART_BAR, bar, cx, cy, 0.2f, 0.2f, 0.2f, 1.0f);
         // Wheels
         drawWheel(cx - 10, cy + 6, 6);
         drawWheel(cx + 10, cy + 6, 6);
-        glPopMatrix();
+        custom_pop_matrix();
     }
 }
 
 // ------------------- Fireworks -------------------
+// Each firework is a burst of particles in a fixed-capacity
+// structure-of-arrays pool. Live particles are packed into [0, count); a
+// dead one is overwritten by the last live one (swap-remove), so nothing is
+// allocated after initScene. The arrays are padded to a multiple of four so
+// the update can run over whole groups of four.
+struct ParticlePool {
+    int capacity = 0, count = 0;
+    vector<float> x, y, vx, vy;
+    vector<float> life, fade;   // ticks left, 1 / initial life
+    vector<uint32_t> color;     // packed RGB; alpha comes from the life left
+
+    void allocate(int n) {
+        capacity = max(n, 0);
+        count = 0;
+        size_t padded = ((size_t)capacity + 3) & ~(size_t)3;
+        for (auto* v : { &x, &y, &vx, &vy, &life, &fade }) v->assign(padded, 0.0f);
+        color.assign(padded, 0);
+    }
+    // index of a new particle, or -1 when the pool is full
+    int spawn() { return count < capacity ? count++ : -1; }
+    void remove(int i) {
+        int last = --count;
+        x[i] = x[last]; y[i] = y[last]; vx[i] = vx[last]; vy[i] = vy[last];
+        life[i] = life[last]; fade[i] = fade[last]; color[i] = color[last];
+    }
+};
+
+ParticlePool particles;
+int particleCapacity = 100000;
+int burstParticles = 600;     // particles per firework
+int fireworkSpawnChance = 4;  // percent per tick at night
+const float PARTICLE_GRAVITY = 0.03f;   // pixels / tick^2
+
 void spawnFirework() {
-    Firework fw;
-    fw.x = rand() % 700 + 80;
-    fw.y = rand() % 250 + 380;
-    fw.radius = 1.0f;
-    fw.r = (rand() % 100) / 100.0f;
-    fw.g = (rand() % 100) / 100.0f;
-    fw.b = (rand() % 100) / 100.0f;
-    fw.alpha = 1.0f;
-    fw.active = true;
+    TRACE_FUNCTION();
+    float cx = rand() % 700 + 80;
+    float cy = rand() % 250 + 380;
+    uint32_t rgb = packColor((rand() % 100) / 100.0f, (rand() % 100) / 100.0f, (rand() % 100) / 100.0f, 0) & 0xFFFFFF;
+    for (int n = 0; n < burstParticles; n++) {
+        int i = particles.spawn();
+        if (i < 0) return;
+        float speed = 0.4f + (rand() % 100) * 0.016f;
+        int angle = rand() % 360;
+        float life = 40.0f + rand() % 30;
+        particles.x[i] = cx; particles.y[i] = cy;
+        particles.vx[i] = speed * (float)cosDeg(angle);
+        particles.vy[i] = speed * (float)sinDeg(angle);
+        particles.life[i] = life;
+        particles.fade[i] = 1.0f / life;
+        particles.color[i] = rgb;
+    }
+}
 
-    fireworks.push_back(fw);
+// One tick of motion, four particles per step with GCC vector types (SSE
+// on x86, NEON on ARM). The last group may run into padding or dead slots,
+// which is harmless. Dead and off-screen particles are then swap-removed.
+typedef float Float4 __attribute__((vector_size(16)));
+
+inline Float4 load4(const float* p) { Float4 v; memcpy(&v, p, sizeof(v)); return v; }
+inline void store4(float* p, Float4 v) { memcpy(p, &v, sizeof(v)); }
+
+void stepParticles() {
+    TRACE_FUNCTION();
+    float* x = particles.x.data();
+    float* y = particles.y.data();
+    const float* vx = particles.vx.data();
+    float* vy = particles.vy.data();
+    float* life = particles.life.data();
+    for (int i = 0; i < particles.count; i += 4) {
+        Float4 v = load4(vy + i) - PARTICLE_GRAVITY;
+        store4(vy + i, v);
+        store4(x + i, load4(x + i) + load4(vx + i));
+        store4(y + i, load4(y + i) + v);
+        store4(life + i, load4(life + i) - 1.0f);
+    }
+    for (int i = 0; i < particles.count;) {
+        if (life[i] <= 0 || x[i] < 0 || x[i] >= SCENE_W || y[i] < 0) particles.remove(i);
+        else i++;
+    }
 }
 
+// Additive square sparks (2x2 scene units), faded by the life left.
+// Saturating adds commute, so the order swap-remove leaves the particles
+// in does not matter.
 void drawFireworks() {
-    for (auto& fw : fireworks) {
-        if (!fw.active) continue;
-        vector<pair<int, int>> poly;
-        for (int a = 0; a < 360; a++) {
-            poly.push_back({ fw.x + (int)round(fw.radius * cos(a * M_PI / 180.0)), fw.y + (int)round(fw.radius * sin(a * M_PI / 180.0)) });
+    TRACE_FUNCTION();
+    if (particles.count == 0) return;
+    setBlendMode(BLEND_ADD);
+    const Matrix3& m = deviceMatrix;
+    const Rect& view = deviceViewport;
+    int size = sparkSize;
+    if (recordingActive()) {
+        // one CMD_SPARKS for the whole pool, copied so the simulation can move on
+        vector<Spark>& sparks = recording->sparks;
+        size_t first = sparks.size();
+        Rect b = { INT_MAX, INT_MAX, INT_MIN, INT_MIN };
+        for (int i = 0; i < particles.count; i++) {
+            int px = (int)floorf((int)particles.x[i] * m.a + m.e), py = (int)floorf((int)particles.y[i] * m.d + m.f);
+            if (px < view.x0 || py < view.y0 || px + size - 1 > view.x1 || py + size - 1 > view.y1) continue;
+            uint32_t a = (uint32_t)min(255.0f, particles.life[i] * particles.fade[i] * 255.0f + 0.5f);
+            sparks.push_back({ px, py, premultiply(particles.color[i] | (a << 24)) });
+            b.x0 = min(b.x0, px); b.x1 = max(b.x1, px + size - 1);
+            b.y0 = min(b.y0, py); b.y1 = max(b.y1, py + size - 1);
         }
-        scanlineFill(poly, fw.r, fw.g, fw.b, fw.alpha);
+        if (sparks.size() > first)
+            recordCommand(CMD_SPARKS, (int)first, (int)(sparks.size() - first), size, 0, b);
     }
+    else {
+        glPointSize((float)size);
+        glDrawCalls++;
+        glBegin(GL_POINTS);
+        for (int i = 0; i < particles.count; i++) {
+            int px = (int)floorf((int)particles.x[i] * m.a + m.e), py = (int)floorf((int)particles.y[i] * m.d + m.f);
+            if (px < view.x0 || py < view.y0 || px + size - 1 > view.x1 || py + size - 1 > view.y1) continue;
+            uint32_t c = particles.color[i];
+            glColor4ub(c & 0xFF, (c >> 8) & 0xFF, (c >> 16) & 0xFF,
+                       (GLubyte)min(255.0f, particles.life[i] * particles.fade[i] * 255.0f + 0.5f));
+            glVertex2f(px + size * 0.5f, py + size * 0.5f);
+        }
+        glEnd();
+        glPointSize(1.0f);
+    }
+    setBlendMode(BLEND_OVER);
 }
-// ------------------- Display -------------------
-void display() {
+// ------------------- Scene Files -------------------
+// With --scene=FILE the trees, tents, houses, Ferris wheels, cars, birds,
+// clouds and stars come from a scene file (see scene_file.h) instead of the
+// fixed layout. The records are drawn straight from the read-only mapping:
+// each one through the element function of its type, under a translate,
+// rotate and scale that puts the type's anchor at the object's position.
+// Animation is a function of sceneTick and the record alone, so objects
+// carry no state and loading allocates nothing per object. Ground, road,
+// sun, moon, carts and fireworks are drawn as usual, and the coaster
+// follows the file's control points if it has any.
+SceneFile sceneFile;
+
+enum ScenePass {
+    SCENE_PASS_GROUND,     // static layer: trees, tent and house bodies, wheel frames
+    SCENE_PASS_STARS,      // static layer, at night
+    SCENE_PASS_FIXTURES,   // animated: flags and wheel spokes
+    SCENE_PASS_CLOUDS,     // animated, by day
+    SCENE_PASS_TRAFFIC     // animated: cars and birds, over the coaster
+};
+const unsigned SCENE_ANIMATED_PASSES = 1 << SCENE_PASS_FIXTURES | 1 << SCENE_PASS_CLOUDS | 1 << SCENE_PASS_TRAFFIC;
 
-    if (isNight) glClearColor(0.02f, 0.02f, 0.15f, 1.0f);
-    else glClearColor(0.5f, 0.8f, 1.0f, 1.0f);
-    glClear(GL_COLOR_BUFFER_BIT);
+struct SceneTypeInfo {
+    float anchorX, anchorY;   // where the element function draws the object's (x, y)
+    Rect bounds;              // around the anchor, unscaled, including flags and wings
+    unsigned passes;          // 1 << ScenePass for each pass that draws the type
+};
+const SceneTypeInfo sceneTypes[SCENE_TYPE_COUNT] = {
+    { 10, 0, { -40, 0, 40, 160 }, 1 << SCENE_PASS_GROUND },                                  // drawTree(0, 0)
+    { 200, 150, { -120, 0, 120, 294 }, 1 << SCENE_PASS_GROUND | 1 << SCENE_PASS_FIXTURES },  // drawTent
+    { 500, 150, { -120, 0, 120, 294 }, 1 << SCENE_PASS_GROUND | 1 << SCENE_PASS_FIXTURES },  // drawHouse
+    { 160, 90, { -62, -2, 62, 122 }, 1 << SCENE_PASS_TRAFFIC },                              // drawCar(0, variant)
+    { 0, 0, { -21, -16, 21, 16 }, 1 << SCENE_PASS_TRAFFIC },                                 // drawBird(0, 0)
+    { 0, 0, { -61, -41, 61, 41 }, 1 << SCENE_PASS_CLOUDS },                                  // drawCloud(0, 0)
+    { 700, 150, { -121, 0, 121, 262 }, 1 << SCENE_PASS_GROUND | 1 << SCENE_PASS_FIXTURES },  // drawFerrisWheel
+    { 0, 0, { -3, -1, 7, 9 }, 1 << SCENE_PASS_STARS },                                       // drawStar(0, 0)
+};
+
+// Cars, birds and clouds move along x and wrap around, like the built-in
+// ones, far enough outside the scene that they leave it whole.
+float sceneObjectX(const SceneObject& o) {
+    if (o.type != SCENE_CAR && o.type != SCENE_BIRD && o.type != SCENE_CLOUD) return o.x;
+    double margin = 200.0 * max(1.0f, o.scale), span = SCENE_W + 2 * margin;
+    double x = fmod(o.x + margin + (double)o.speed * ((double)sceneTick + o.phase), span);
+    return (float)((x < 0 ? x + span : x) - margin);
+}
+
+// Scene-unit bounds of o drawn at x.
+Rect sceneObjectBounds(const SceneObject& o, float x) {
+    const Rect& b = sceneTypes[o.type].bounds;
+    float x0 = (float)b.x0, y0 = (float)b.y0, x1 = (float)b.x1, y1 = (float)b.y1;
+    if (o.rotation != 0) {
+        // any rotation about the anchor stays inside this radius
+        float r = sqrtf(max(x0 * x0, x1 * x1) + max(y0 * y0, y1 * y1));
+        x0 = y0 = -r; x1 = y1 = r;
+    }
+    return { (int)floorf(x + x0 * o.scale), (int)floorf(o.y + y0 * o.scale),
+             (int)ceilf(x + x1 * o.scale), (int)ceilf(o.y + y1 * o.scale) };
+}
+
+bool sceneRectVisible(const Rect& r) { return r.x1 >= 0 && r.x0 < SCENE_W && r.y1 >= 0 && r.y0 < SCENE_H; }
+
+void drawSceneObject(const SceneObject& o, float x, ScenePass pass) {
+    const SceneTypeInfo& info = sceneTypes[o.type];
+    custom_push_matrix();
+    custom_translate(x, o.y);
+    if (o.rotation != 0) custom_rotate(o.rotation);
+    if (o.scale != 1) custom_scale(o.scale, o.scale);
+    custom_translate(-info.anchorX, -info.anchorY);
+    drawTint = o.color;
+    float t = (float)sceneTick + o.phase;
+    switch (o.type) {
+    case SCENE_TREE: drawTree(0, 0); break;
+    case SCENE_TENT: if (pass == SCENE_PASS_GROUND) drawTent(); else drawTentFlag(0.1f * t); break;
+    case SCENE_HOUSE: if (pass == SCENE_PASS_GROUND) drawHouse(); else drawHouseFlag(0.1f * t); break;
+    case SCENE_CAR: drawCar(0, o.variant); break;
+    case SCENE_BIRD: drawBird(0, 0); break;
+    case SCENE_CLOUD: drawCloud(0, 0); break;
+    case SCENE_FERRIS_WHEEL:
+        if (pass == SCENE_PASS_GROUND) drawFerrisWheelFrame();
+        else drawFerrisWheel(fmodf(o.speed * t, 360.0f));
+        break;
+    case SCENE_STAR: drawStar(0, 0); break;
+    }
+    drawTint = 0;
+    custom_pop_matrix();
+}
+
+// Draws the visible objects of one pass in file order.
+void drawSceneObjects(ScenePass pass) {
+    TRACE_FUNCTION();
+    for (uint32_t i = 0; i < sceneFile.objectCount; i++) {
+        const SceneObject& o = sceneFile.objects[i];
+        if (!(sceneTypes[o.type].passes & 1u << pass)) continue;
+        float x = sceneObjectX(o);
+        if (sceneRectVisible(sceneObjectBounds(o, x))) drawSceneObject(o, x, pass);
+    }
+}
+
+// Maps path as the scene (nullptr for the built-in layout); call
+// initScene() afterwards so the layers are redrawn.
+bool loadSceneFile(const char* path) {
+    sceneFile.close();
+    coasterTrack.assign(begin(builtinCoasterTrack), end(builtinCoasterTrack));
+    if (!path) return true;
+    string error;
+    if (!sceneFile.open(path, error)) {
+        cerr << error << endl;
+        return false;
+    }
+    if (sceneFile.controlPointCount > 0) {
+        coasterTrack.clear();
+        coasterTrack.reserve(sceneFile.controlPointCount);   // one allocation however long the track
+        for (uint32_t i = 0; i < sceneFile.controlPointCount; i++)
+            coasterTrack.push_back({ sceneFile.controlPoints[i].x, sceneFile.controlPoints[i].y });
+    }
+    return true;
+}
+
+
+// ------------------- Layers -------------------
+// The scene is split into a static layer (never changes within a day/night
+// mode) and animated sprites drawn on top. On the framebuffer target the
+// static layer is rasterized once per mode into backgroundLayer; each frame
+// only the rectangles covered by sprites now or last frame are restored
+// from it before the sprites are redrawn.
+bool useLayerCache = true;
+Framebuffer backgroundLayer;
+int backgroundMode = -1;   // isNight value of the last recorded background, -1 = none
+vector<Rect> dirtyRects, prevDirtyRects;
+
+// Takes scene units; the rectangle is stored in device pixels.
+void markDirty(int x0, int y0, int x1, int y1) {
+    Rect r = deviceRect(x0, y0, x1, y1);
+    r.x0 = max(r.x0, 0); r.y0 = max(r.y0, 0);
+    r.x1 = min(r.x1, frame.width - 1); r.y1 = min(r.y1, frame.height - 1);
+    if (r.x0 <= r.x1 && r.y0 <= r.y1) dirtyRects.push_back(r);
+}
+
+void drawStaticLayer() {
+    TRACE_FUNCTION();
+    if (isNight) clearFrame(0.02f, 0.02f, 0.15f);
+    else clearFrame(0.5f, 0.8f, 1.0f);
     drawGround();
     drawRoad();
-    drawTent();
-    drawHouse();
-    drawTree(50, 150);
-    drawTree(300, 150);
-    drawFerrisWheel();
+    if (sceneFile.isOpen()) drawSceneObjects(SCENE_PASS_GROUND);
+    else {
+        drawTent();
+        drawHouse();
+        drawTree(50, 150);
+        drawTree(300, 150);
+        drawFerrisWheelFrame();
+    }
     if (isNight) {
         drawMoon();
-
         for (const auto& pos : starPositions) {
             drawStar(pos.first, pos.second);
         }
+        if (sceneFile.isOpen()) drawSceneObjects(SCENE_PASS_STARS);
+    }
+    drawCoasterTrack();
+}
+
+// One dirty rectangle per visible animated object, up to a limit; past it
+// the rectangles would cost more than they save and the whole scene is
+// marked instead.
+size_t sceneDirtyLimit = 64;
+
+void markSceneBounds() {
+    size_t marked = 0, first = dirtyRects.size();
+    for (uint32_t i = 0; i < sceneFile.objectCount; i++) {
+        const SceneObject& o = sceneFile.objects[i];
+        unsigned passes = sceneTypes[o.type].passes & SCENE_ANIMATED_PASSES;
+        if (isNight) passes &= ~(1u << SCENE_PASS_CLOUDS);
+        if (!passes) continue;
+        Rect r = sceneObjectBounds(o, sceneObjectX(o));
+        if (!sceneRectVisible(r)) continue;
+        if (++marked > sceneDirtyLimit) {
+            dirtyRects.resize(first);
+            markDirty(0, 0, SCENE_W - 1, SCENE_H - 1);
+            return;
+        }
+        markDirty(r.x0, r.y0, r.x1, r.y1);
+    }
+}
+
+// Conservative bounds of everything drawAnimatedLayer touches this frame.
+void markAnimatedBounds() {
+    bool builtin = !sceneFile.isOpen();
+    if (builtin) {
+        markDirty(198, 396, 244, 444);        // tent flag, including shear
+        markDirty(498, 396, 544, 444);        // house flag
+        markDirty(583, 183, 817, 417);        // spokes and cabins
+    }
+    else markSceneBounds();
+    if (isNight && particles.count > 0) {
+        // one box around all particles; bursts overlap most of the sky anyway
+        float x0 = particles.x[0], x1 = x0, y0 = particles.y[0], y1 = y0;
+        for (int i = 1; i < particles.count; i++) {
+            x0 = min(x0, particles.x[i]); x1 = max(x1, particles.x[i]);
+            y0 = min(y0, particles.y[i]); y1 = max(y1, particles.y[i]);
+        }
+        markDirty((int)x0, (int)y0, (int)x1 + 1, (int)y1 + 1);
+    }
+    else {
+        int sx = (int)round(sunX);
+        markDirty(sx - 61, 539, sx + 61, 661);
+        if (builtin) {
+            markDirty(200 + (int)cloudX - 61, 600 - 41, 200 + (int)cloudX + 61, 600 + 41);
+            markDirty(500 + (int)cloudX - 61, 550 - 41, 500 + (int)cloudX + 61, 550 + 41);
+        }
+    }
+    for (int i = 0; i < 5; i++) {
+        pair<int, int> c = getCartPos(cartT - i * 0.2f);
+        markDirty(c.first - 45, c.second - 45, c.first + 45, c.second + 50);
+    }
+    if (!builtin) return;
+    for (float x : { car1X, car2X }) {
+        int dx = (int)round(x);
+        markDirty(dx + 100, 88, dx + 222, 212);
+    }
+    markDirty((int)birdX - 21, 584, (int)birdX + 141, 636);
+}
+
+void drawAnimatedLayer() {
+    TRACE_FUNCTION();
+    bool builtin = !sceneFile.isOpen();
+    if (builtin) {
+        drawTentFlag(flagTime);
+        drawHouseFlag(flagTime);
+        drawFerrisWheel(wheelAngle);
+    }
+    else drawSceneObjects(SCENE_PASS_FIXTURES);
+    if (isNight) {
         drawFireworks();
     }
     else {
         drawSun();
-        drawCloud(200 + (int)cloudX, 600);
-        drawCloud(500 + (int)cloudX, 550);
+        if (builtin) {
+            drawCloud(200 + (int)cloudX, 600);
+            drawCloud(500 + (int)cloudX, 550);
+        }
+        else drawSceneObjects(SCENE_PASS_CLOUDS);
     }
+    // the track is drawn over the wheel and sky, so repaint it (opaque lines
+    // are idempotent) before the carts, cars and birds
     drawCoasterTrack();
     drawCartTrain();
-    drawCar(car1X, 0);
-    drawCar(car2X, 1);
-    drawBird((int)birdX, 600);
-    drawBird((int)birdX + 60, 620);
-    drawBird((int)birdX + 120, 610);
-    glFlush();
+    if (builtin) {
+        drawCar(car1X, 0);
+        drawCar(car2X, 1);
+        drawBird((int)birdX, 600);
+        drawBird((int)birdX + 60, 620);
+        drawBird((int)birdX + 120, 610);
+    }
+    else drawSceneObjects(SCENE_PASS_TRAFFIC);
+}
+
+// ------------------- Frame Snapshots -------------------
+// A framebuffer frame is recorded and rasterized in two steps. recordFrame()
+// runs the scene functions against the current animation state and only
+// reads it; renderFrame() rasterizes the result and touches nothing but the
+// framebuffers. The snapshot is self-contained, so a frame can be rendered
+// on another thread while the scene moves on, or replayed for profiling.
+struct FrameSnapshot {
+    bool cached = false;              // drawn over backgroundLayer
+    bool rebuildBackground = false;   // rasterize `background` into backgroundLayer first
+    CommandBuffer background;         // static layer, recorded when the mode changed
+    vector<Rect> dirtyRects;          // restored from backgroundLayer before `commands`
+    CommandBuffer commands;
+};
+
+void recordFrame(FrameSnapshot& s) {
+    TRACE_FUNCTION();
+    s.cached = useLayerCache && renderTarget == TARGET_FRAMEBUFFER;   // the layers live in memory
+    s.rebuildBackground = false;
+    s.background.clear();
+    s.commands.clear();
+    s.dirtyRects.clear();
+    if (s.cached) {
+        int mode = isNight ? 1 : 0;
+        if (backgroundMode != mode) {
+            recording = &s.background;
+            drawStaticLayer();
+            backgroundMode = mode;
+            s.rebuildBackground = true;
+        }
+        dirtyRects.clear();
+        markAnimatedBounds();
+        s.dirtyRects.swap(dirtyRects);
+    }
+    recording = &s.commands;
+    if (!s.cached) drawStaticLayer();
+    drawAnimatedLayer();
+    recording = &immediateCommands;
+}
+
+void renderFrame(const FrameSnapshot& s) {
+    TRACE_FUNCTION();
+    if (s.cached) {
+        if (s.rebuildBackground) {
+            rasterizeCommands(s.background);
+            backgroundLayer = frame;
+        }
+        else {
+            const vector<Rect>* lists[] = { &prevDirtyRects, &s.dirtyRects };
+            for (const vector<Rect>* list : lists) {
+                for (const Rect& r : *list) {
+                    size_t n = (size_t)(r.x1 - r.x0 + 1);
+                    for (int y = r.y0; y <= r.y1; y++)
+                        memcpy(frame.row(y) + r.x0, backgroundLayer.row(y) + r.x0, n * sizeof(uint32_t));
+                }
+            }
+        }
+        prevDirtyRects = s.dirtyRects;
+    }
+    rasterizeCommands(s.commands);
+}
+
+// ------------------- Simulation Thread -------------------
+// With --pipeline the animation runs on its own thread: it records frame
+// N + 1 into one snapshot and steps the scene while the render thread
+// rasterizes frame N from the other. The two snapshots are handed back and
+// forth in lockstep, so every frame is rendered exactly once and in order
+// and the images match the single-threaded renderer. Keys are queued and
+// applied by the simulation thread before it records its next frame.
+void stepSimulation();
+void applyKey(unsigned char key);
+
+class SimulationPipeline {
+public:
+    SimulationPipeline() : simulation(&SimulationPipeline::simulationLoop, this) {}
+
+    ~SimulationPipeline() {
+        { lock_guard<mutex> lock(m); quit = true; }
+        changed.notify_all();
+        simulation.join();
+    }
+
+    // Waits for the next recorded frame; it stays valid until release().
+    const FrameSnapshot& acquire() {
+        TRACE_SCOPE("wait for simulation");
+        unique_lock<mutex> lock(m);
+        changed.wait(lock, [this] { return produced > consumed; });
+        return slots[consumed % 2];
+    }
+
+    void release() {
+        { lock_guard<mutex> lock(m); consumed++; }
+        changed.notify_all();
+    }
+
+    void postKey(unsigned char key) {
+        lock_guard<mutex> lock(m);
+        keys.push_back(key);
+    }
+
+private:
+    FrameSnapshot slots[2];
+    mutex m;
+    condition_variable changed;
+    uint64_t produced = 0, consumed = 0;
+    vector<unsigned char> keys;
+    bool quit = false;
+    thread simulation;   // declared last so it starts after the state above
+
+    void simulationLoop() {
+        traceThreadName("simulation");
+        vector<unsigned char> pending;
+        for (;;) {
+            uint64_t frameIndex;
+            {
+                unique_lock<mutex> lock(m);
+                changed.wait(lock, [this] { return quit || produced - consumed < 2; });
+                if (quit) return;
+                frameIndex = produced;
+                pending.swap(keys);
+            }
+            for (unsigned char key : pending) applyKey(key);
+            pending.clear();
+            recordFrame(slots[frameIndex % 2]);
+            stepSimulation();
+            { lock_guard<mutex> lock(m); produced++; }
+            changed.notify_all();
+        }
+    }
+};
+
+unique_ptr<SimulationPipeline> pipeline;
+
+// ------------------- Shared-Memory Sink -------------------
+// With --shm=NAME every displayed frame is also published to
+// /dev/shm/NAME for other local processes (see shm_frame_sink.h and
+// shm_frame_reader.cpp). The framebuffer targets copy their image in; the
+// GL targets read the window back straight into the slot.
+const char* shmName = nullptr;
+int shmSlots = 3;
+ShmFrameSink shmSink;
+
+void publishFrame() {
+    TRACE_FUNCTION();
+    if (!shmName) return;
+    if (shmSink.width() != outputW || shmSink.height() != outputH) {
+        if (!shmSink.open(shmName, outputW, outputH, shmSlots)) {
+            cerr << "Could not create /dev/shm/" << shmName << endl;
+            shmName = nullptr;
+            return;
+        }
+    }
+    if (renderTarget == TARGET_FRAMEBUFFER) shmSink.publish(displayedFrame().pixels.data());
+    else {
+        glReadPixels(0, 0, outputW, outputH, GL_RGBA, GL_UNSIGNED_BYTE, shmSink.beginFrame());
+        shmSink.endFrame();
+    }
+}
+
+// ------------------- Display -------------------
+FrameSnapshot displaySnapshot;   // recorded and rendered in place without --pipeline
+
+void display() {
+    TRACE_FUNCTION();
+    PERF_SCOPE(perfFrameOther, 1);
+    if (renderTarget == TARGET_FRAMEBUFFER) {
+        if (pipeline) {
+            renderFrame(pipeline->acquire());
+            pipeline->release();
+        }
+        else {
+            recordFrame(displaySnapshot);
+            renderFrame(displaySnapshot);
+        }
+        resolveFrame();
+    }
+    else if (renderTarget == TARGET_GL_BATCHED) {
+        recordFrame(displaySnapshot);
+        submitBatched(displaySnapshot.commands);
+    }
+    else {
+        drawStaticLayer();
+        drawAnimatedLayer();
+    }
+    presentFrame();
+    publishFrame();
 }
 
 // ------------------- Animation -------------------
-void update(int) {
+// One animation tick (30 ms of scene time). Pure state update: the GLUT
+// timer and the headless renderer both drive it, or the simulation thread
+// with --pipeline.
+void stepSimulation() {
+    TRACE_FUNCTION();
 
     wheelAngle += 3.0f; if (wheelAngle > 360.0f) wheelAngle -= 360.0f;
     sunX += 0.2f; if (sunX > 900) sunX = 0;
@@ -460,22 +2314,11 @@ void update(int) {
     if (cartT > (float)(coasterTrack.size() - 1)) cartT = 0.0f;
 
     if (isNight) {
-        if (rand() % 100 < 4) spawnFirework();
-        for (auto& fw : fireworks) {
-            if (!fw.active) continue;
-            fw.radius += 1.2f;
-            fw.alpha -= 0.02f;
-            if (fw.radius > 45.0f || fw.alpha <= 0) {
-                fw.active = false;
-            }
-        }
-
-        fireworks.erase(remove_if(fireworks.begin(), fireworks.end(), [](const Firework& f) { return !f.active; }), fireworks.end());
+        if (rand() % 100 < fireworkSpawnChance) spawnFirework();
+        stepParticles();
     }
     else {
-
-        for (auto& fw : fireworks) fw.active = false;
-        fireworks.clear();
+        particles.count = 0;
     }
 
 
@@ -484,13 +2327,19 @@ void update(int) {
     else { flagShear -= 0.02f; if (flagShear < -0.3f) shearDir = true; }
 
     flagTime += 0.1f;
+    sceneTick++;
+}
 
+const int TICK_MS = 30;
 
+void update(int) {
+    TRACE_FUNCTION();
+    if (!pipeline) stepSimulation();   // otherwise display() picks up the next snapshot
     glutPostRedisplay();
-    glutTimerFunc(30, update, 0);
+    glutTimerFunc(TICK_MS, update, 0);
 }
 // ------------------- Keyboard -------------------
-void keyboard(unsigned char key, int x, int y) {
+void applyKey(unsigned char key) {
     if (key == 'n' || key == 'N') {
         isNight = true;
 
@@ -500,35 +2349,185 @@ void keyboard(unsigned char key, int x, int y) {
         isNight = false;
     }
 }
+
+void keyboard(unsigned char key, int x, int y) {
+    if (pipeline) pipeline->postKey(key);
+    else applyKey(key);
+}
 // ------------------- Init -------------------
-void init() {
-    srand((unsigned int)time(NULL));
-    fireworks.clear();
+void initScene(unsigned int seed) {
+    srand(seed);
+    // animation back to its start, so a scene can be replayed from the same seed
+    wheelAngle = 0; car1X = -100; car2X = 900;
+    sunX = 80; cloudX = -150; birdX = 900;
+    wingAngle = 0; wingUp = true;
+    isNight = false; cartT = 0.0f;
+    flagShear = 0.0f; shearDir = true; flagTime = 0.0f;
+    sceneTick = 0;
+    particles.allocate(particleCapacity);
+    starPositions.clear();
 
 
     for (int i = 0; i < 50; ++i) {
 
         starPositions.push_back({ rand() % 900, rand() % 300 + 400 });
     }
+    setOutputSize(outputW, outputH);
+    backgroundMode = -1;
+    prevDirtyRects.clear();
+}
 
+void init() {
     glPointSize(1.0f);
 
     glEnable(GL_BLEND);
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
     glClearColor(0.5f, 0.8f, 1.0f, 1.0f);
-    gluOrtho2D(0, 900, 0, 700);
 }
+
+// The GL targets draw straight into the window, so the window is the
+// device; the framebuffer target keeps the size it was started with and
+// is drawn at the bottom-left corner.
+void reshape(int w, int h) {
+    glViewport(0, 0, w, h);
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    gluOrtho2D(0, w, 0, h);
+    glMatrixMode(GL_MODELVIEW);
+    if (renderTarget != TARGET_FRAMEBUFFER) setOutputSize(w, h);
+}
+
+// ------------------- Headless Rendering -------------------
+// Renders frames back to back on the simulated clock (one stepSimulation per
+// frame, TICK_MS of scene time each) into the memory framebuffer, with no GL
+// context or window. Each frame is copied into a slot of the frame writer's
+// ring and the writer thread converts and writes it while the next frame is
+// rasterized (see frame_writer.h for the formats).
+
+int renderHeadless(int frames, const char* out, FrameFormat format, int slots) {
+    FrameWriter writer;
+    if (!writer.open(format, out, outputW, outputH, 1000, TICK_MS, slots)) {
+        cerr << "Could not open " << out << endl;
+        return 1;
+    }
+    for (int i = 0; i < frames && writer.ok(); i++) {
+        display();
+        const Framebuffer& image = displayedFrame();
+        memcpy(writer.acquireSlot(), image.pixels.data(), image.pixels.size() * sizeof(uint32_t));
+        writer.submitSlot();
+        if (!pipeline) stepSimulation();
+    }
+    bool ok = writer.close();
+    writer.printCounters(stderr);
+    if (!ok) {
+        cerr << "Failed to write frames to " << out << endl;
+        return 1;
+    }
+    return 0;
+}
+
+// With --trace=FILE the scene functions, the raster workers, the
+// simulation thread and the frame writer record trace events (see
+// trace_events.h), written to FILE when the program exits; the simulation
+// thread is stopped first so that no thread is still recording.
+const char* traceFile = nullptr;
+
+void finishTrace() {
+    pipeline.reset();
+    if (!writeTraceJson(traceFile)) cerr << "Failed to write trace " << traceFile << endl;
+}
+
+// With --perf the stage counters are printed to stderr at exit, after the
+// simulation thread has stopped.
+void finishPerf() {
+    pipeline.reset();
+    printPerfReport(stderr);
+}
+
+// Accepts "--name value" and "--name=value"; returns nullptr if argv[i] is
+// not that option.
+const char* optionValue(int argc, char** argv, int& i, const char* name) {
+    size_t len = strlen(name);
+    if (strncmp(argv[i], name, len) != 0) return nullptr;
+    if (argv[i][len] == '=') return argv[i] + len + 1;
+    if (argv[i][len] == '\0' && i + 1 < argc) return argv[++i];
+    return nullptr;
+}
+
 // ------------------- Main -------------------
+// Tools that reuse the engine (the benchmark) define PARK_NO_MAIN and
+// include this file.
+#ifndef PARK_NO_MAIN
 int main(int argc, char** argv) {
+    selectSpanKernels();
+    int frames = 0;
+    unsigned int seed = (unsigned int)time(NULL);
+    const char* out = "-";
+    const char* tracePath = nullptr;
+    const char* scenePath = nullptr;
+    bool startAtNight = false, usePipeline = false, y4m = false;
+    int writerSlots = 4;
+    for (int i = 1; i < argc; i++) {
+        const char* v;
+        if (strcmp(argv[i], "--framebuffer") == 0) renderTarget = TARGET_FRAMEBUFFER;
+        else if (strcmp(argv[i], "--gl-batch") == 0) renderTarget = TARGET_GL_BATCHED;
+        else if (strcmp(argv[i], "--no-layer-cache") == 0) useLayerCache = false;
+        else if (strcmp(argv[i], "--no-sprite-cache") == 0) useSpriteCache = false;
+        else if (strcmp(argv[i], "--night") == 0) startAtNight = true;
+        else if (strcmp(argv[i], "--pipeline") == 0) usePipeline = true;
+        else if ((v = optionValue(argc, argv, i, "--threads"))) rasterThreads = max(0, atoi(v));
+        else if ((v = optionValue(argc, argv, i, "--size"))) {
+            if (sscanf(v, "%dx%d", &outputW, &outputH) != 2 || outputW < 1 || outputH < 1) {
+                cerr << "Bad --size " << v << ", expected WIDTHxHEIGHT" << endl;
+                return 1;
+            }
+        }
+        else if ((v = optionValue(argc, argv, i, "--supersample"))) supersample = max(1, min(8, atoi(v)));
+        else if ((v = optionValue(argc, argv, i, "--particles"))) particleCapacity = max(0, atoi(v));
+        else if ((v = optionValue(argc, argv, i, "--burst"))) burstParticles = max(0, atoi(v));
+        else if ((v = optionValue(argc, argv, i, "--spawn-rate"))) fireworkSpawnChance = max(0, atoi(v));
+        else if ((v = optionValue(argc, argv, i, "--frames"))) { frames = max(0, atoi(v)); headless = true; }
+        else if ((v = optionValue(argc, argv, i, "--seed"))) seed = (unsigned int)strtoul(v, nullptr, 10);
+        else if ((v = optionValue(argc, argv, i, "--out"))) out = v;
+        else if (strcmp(argv[i], "--y4m") == 0) y4m = true;
+        else if ((v = optionValue(argc, argv, i, "--writer-slots"))) writerSlots = max(1, atoi(v));
+        else if ((v = optionValue(argc, argv, i, "--trace"))) tracePath = v;
+        else if ((v = optionValue(argc, argv, i, "--scene"))) scenePath = v;
+        else if (strcmp(argv[i], "--perf") == 0) perfEnabled = true;
+        else if ((v = optionValue(argc, argv, i, "--shm"))) shmName = v;
+        else if ((v = optionValue(argc, argv, i, "--shm-slots"))) shmSlots = max(1, atoi(v));
+        else if ((v = optionValue(argc, argv, i, "--simd")) && !selectSpanKernels(v))
+            cerr << "Unknown or unsupported --simd kernel set, using " << spanKernels->name << endl;
+    }
+    if (perfEnabled) atexit(finishPerf);
+    if (tracePath) {
+        traceFile = tracePath;
+        traceEnable();
+        traceThreadName("main");
+        atexit(finishTrace);
+    }
+    if (scenePath && !loadSceneFile(scenePath)) return 1;
+    initScene(seed);
+    if (startAtNight) keyboard('n', 0, 0);
+    if (headless || usePipeline || supersample > 1) renderTarget = TARGET_FRAMEBUFFER;
+    if (usePipeline) pipeline.reset(new SimulationPipeline());
+    if (headless) {
+        size_t len = strlen(out);
+        if (len > 4 && strcmp(out + len - 4, ".y4m") == 0) y4m = true;
+        FrameFormat format = y4m ? FRAME_Y4M : strcmp(out, "-") == 0 ? FRAME_RGB24 : FRAME_PPM;
+        return renderHeadless(frames, out, format, writerSlots);
+    }
+
     glutInit(&argc, argv);
     glutInitDisplayMode(GLUT_SINGLE | GLUT_RGB);
-    glutInitWindowSize(900, 700);
+    glutInitWindowSize(outputW, outputH);
     glutCreateWindow("Amusement Park Scene");
     init();
     glutDisplayFunc(display);
+    glutReshapeFunc(reshape);
     glutKeyboardFunc(keyboard);
-    glutTimerFunc(30, update, 0);
+    glutTimerFunc(TICK_MS, update, 0);
     glutMainLoop();
     return 0;
 }
-
+#endif
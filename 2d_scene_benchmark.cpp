@@ -0,0 +1,439 @@
+// Rasterization benchmarks for the 2D amusement park engine.
+// COMPILE: g++ -O2 -pthread 2d_scene_benchmark.cpp -o park_bench -lGL -lGLU -lglut -lEGL -lm
+//
+// Sweeps drawLine, drawCircle, fillCircle and scanlineFill over sizes and
+// shapes, times cached sprites against scan conversion and complete day and
+// night frames, loads and draws generated scenes of up to a million
+// objects, times the immediate and batched GL targets in an offscreen
+// context with their draw calls per frame, and writes one JSON record per
+// case. With --baseline, each case is compared against a stored run and
+// the exit status is 1 when any median got slower than --tolerance percent.
+#define PARK_NO_MAIN
+#include "2d_scene_amusement_park.cpp"
+
+#if defined(__linux__)
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#define PARK_BENCH_EGL 1
+#endif
+
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+
+// ------------------- Measurement -------------------
+struct BenchResult {
+    string name;
+    double p50, p90, p99;     // ns per operation (per frame for frame cases)
+    double pixelsPerOp, spansPerOp;
+    long drawCalls = -1;      // GL draw calls per frame, for gl/ cases
+    long differing = -1;      // pixels unlike the framebuffer target's frame, for gl/ cases
+};
+
+vector<BenchResult> results;
+int sampleCount = 25;
+double minSampleNs = 2e6;     // each sample runs enough iterations to take >= 2 ms
+
+double percentile(vector<double> v, double q) {
+    sort(v.begin(), v.end());
+    size_t i = (size_t)min((double)v.size() - 1, q * (v.size() - 1) + 0.5);
+    return v[i];
+}
+
+template <class Fn>
+double timeIterations(Fn& fn, long iterations) {
+    auto t0 = chrono::steady_clock::now();
+    for (long i = 0; i < iterations; i++) fn();
+    auto t1 = chrono::steady_clock::now();
+    return (double)chrono::duration_cast<chrono::nanoseconds>(t1 - t0).count();
+}
+
+template <class Fn>
+void runCase(const string& name, double pixelsPerOp, double spansPerOp, Fn fn) {
+    long iterations = 1;
+    while (timeIterations(fn, iterations) < minSampleNs && iterations < (1L << 30)) iterations *= 2;
+    vector<double> samples;
+    for (int s = 0; s < sampleCount; s++) samples.push_back(timeIterations(fn, iterations) / iterations);
+    results.push_back({ name, percentile(samples, 0.5), percentile(samples, 0.9), percentile(samples, 0.99),
+                        pixelsPerOp, spansPerOp });
+    cerr << name << ": " << results.back().p50 << " ns/op" << endl;
+}
+
+// Counts what a primitive produces without drawing it.
+struct CountingSink : SpanSink {
+    long spans = 0, pixels = 0;
+    void span(int, int x0, int x1) override { spans++; pixels += x1 - x0 + 1; }
+};
+
+// ------------------- Primitive Sweeps -------------------
+// Everything is drawn around the centre of the framebuffer so no case is
+// clipped; translucent variants exercise the blend kernels. The framebuffer
+// target only records the primitive, so each op also flushes the recording
+// to time the rasterization too.
+void finishOp() {
+    if (recordingActive()) flushBins();
+}
+
+void benchLines() {
+    int cx = frame.width / 2, cy = frame.height / 2;
+    for (int len : { 8, 64, 512 }) {
+        for (int slope : { 0, 30, 45, 80 }) {
+            int x1 = cx + (int)round(len / 2.0 * cosDeg(slope)), y1 = cy + (int)round(len / 2.0 * sinDeg(slope));
+            int x0 = 2 * cx - x1, y0 = 2 * cy - y1;
+            long pixels = 0;
+            rasterLine(x0, y0, x1, y1, [&pixels](int, int) { pixels++; });
+            setColor(0, 0, 0);
+            runCase("line/len=" + to_string(len) + "/slope=" + to_string(slope), (double)pixels, 0,
+                    [=] { drawLine(x0, y0, x1, y1); finishOp(); });
+        }
+    }
+}
+
+void benchCircles() {
+    int cx = frame.width / 2, cy = frame.height / 2;
+    for (int r : { 4, 16, 64, 256 }) {
+        long pixels = 0;
+        rasterCircle(cx, cy, r, [&pixels](int, int) { pixels++; });
+        setColor(0, 0, 0);
+        runCase("circle/r=" + to_string(r), (double)pixels, 0, [=] { drawCircle(cx, cy, r); finishOp(); });
+
+        CountingSink counter;
+        fillCircle(cx, cy, r, counter);
+        for (float alpha : { 1.0f, 0.5f }) {
+            runCase("fill_circle/r=" + to_string(r) + (alpha < 1 ? "/alpha" : ""), (double)counter.pixels,
+                    (double)counter.spans, [=] { fillCircle(cx, cy, r, 0.9f, 0.4f, 0.1f, alpha); finishOp(); });
+        }
+    }
+}
+
+void benchPolygons() {
+    int cx = frame.width / 2, cy = frame.height / 2;
+    for (int n : { 3, 8, 32, 128 }) {
+        for (int radius : { 16, 64, 256 }) {
+            vector<pair<int, int>> poly;
+            for (int i = 0; i < n; i++) {
+                double a = 2 * M_PI * i / n;
+                poly.push_back({ cx + (int)round(radius * cos(a)), cy + (int)round(radius * sin(a)) });
+            }
+            CountingSink counter;
+            fillPolygon(poly.data(), poly.size(), counter);
+            for (float alpha : { 1.0f, 0.5f }) {
+                runCase("polygon/n=" + to_string(n) + "/r=" + to_string(radius) + (alpha < 1 ? "/alpha" : ""),
+                        (double)counter.pixels, (double)counter.spans,
+                        [&poly, alpha] { scanlineFill(poly, 0.2f, 0.6f, 0.9f, alpha); finishOp(); });
+            }
+        }
+    }
+}
+
+// Repeated shapes: one star or car per op at a fresh position, drawn from
+// the sprite cache and, for comparison, scan-converted each time.
+void benchSprites() {
+    for (bool cached : { true, false }) {
+        useSpriteCache = cached;
+        string suffix = cached ? "" : "/no_sprite_cache";
+        int i = 0;
+        runCase("sprite/star" + suffix, 0, 0, [&i] {
+            drawStar(100 + i % 700, 100 + (i / 7) % 500); i++; finishOp();
+        });
+        runCase("sprite/car" + suffix, 0, 0, [&i] { drawCar((float)(i % 500), i & 1); i++; finishOp(); });
+    }
+    useSpriteCache = true;
+}
+
+// ------------------- Frame Timing -------------------
+// Whole display() frames, stepping the simulation between frames so the
+// moving objects and fireworks change as they would on screen.
+void benchFrames() {
+    for (bool night : { false, true }) {
+        for (bool cache : { true, false }) {
+            initScene(1);
+            isNight = false;
+            if (night) keyboard('n', 0, 0);
+            useLayerCache = cache;
+            for (int i = 0; i < 10; i++) { display(); stepSimulation(); }
+            string name = string("frame/") + (night ? "night" : "day") + (cache ? "" : "/no_layer_cache");
+            runCase(name, (double)frame.width * frame.height, 0, [] { display(); stepSimulation(); });
+        }
+    }
+    useLayerCache = true;
+
+    // large outputs: the same scene mapped to 4K and 8K, and 4K rendered at
+    // 8K and box-filtered down
+    struct { int w, h, ss; } sizes[] = { { 3840, 2160, 1 }, { 7680, 4320, 1 }, { 3840, 2160, 2 } };
+    for (const auto& size : sizes) {
+        outputW = size.w; outputH = size.h; supersample = size.ss;
+        initScene(1);
+        for (int i = 0; i < 5; i++) { display(); stepSimulation(); }
+        string name = "frame/day/size=" + to_string(size.w) + "x" + to_string(size.h) +
+                      (size.ss > 1 ? "/supersample=" + to_string(size.ss) : "");
+        runCase(name, (double)frame.width * frame.height, 0, [] { display(); stepSimulation(); });
+    }
+    outputW = SCENE_W; outputH = SCENE_H; supersample = 1;
+
+    // firework stress: a burst every tick keeps the 100k pool full
+    int savedBurst = burstParticles, savedChance = fireworkSpawnChance, savedCapacity = particleCapacity;
+    particleCapacity = 100000;
+    burstParticles = 3000;
+    fireworkSpawnChance = 100;
+    initScene(1);
+    keyboard('n', 0, 0);
+    for (int i = 0; i < 60; i++) { display(); stepSimulation(); }
+    cerr << "live particles: " << particles.count << endl;
+    runCase("frame/night/particles=100k", (double)frame.width * frame.height, 0, [] { display(); stepSimulation(); });
+
+    // the two halves of that frame: recording it, and replaying the recording
+    static FrameSnapshot snapshot;
+    useLayerCache = false;
+    recordFrame(snapshot);
+    runCase("frame/night/particles=100k/record", (double)frame.width * frame.height, 0, [] { recordFrame(snapshot); });
+    runCase("frame/night/particles=100k/replay", (double)frame.width * frame.height, 0, [] { renderFrame(snapshot); });
+    useLayerCache = true;
+    burstParticles = savedBurst; fireworkSpawnChance = savedChance; particleCapacity = savedCapacity;
+}
+
+// ------------------- Scene Files -------------------
+// Generated stress scenes of 10k, 100k and 1M objects: mapping and
+// validating the file, and whole day frames drawn from it (the ground
+// objects come from the layer cache; every car, bird, cloud, flag and wheel
+// is redrawn each frame).
+void benchScenes() {
+    char path[] = "/tmp/park_bench_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) return;
+    close(fd);
+    vector<SceneObject> objects;
+    vector<SceneControlPoint> controlPoints;
+    for (uint32_t count : { 10000u, 100000u, 1000000u }) {
+        stressScene(count, 1, 10, 6, objects, controlPoints);
+        if (!writeSceneFile(path, objects, controlPoints)) break;
+        string name = "scene/objects=" + to_string(count);
+        runCase(name + "/load", 0, 0, [&path] { loadSceneFile(path); });
+        initScene(1);
+        for (int i = 0; i < 3; i++) { display(); stepSimulation(); }
+        runCase(name, (double)frame.width * frame.height, 0, [] { display(); stepSimulation(); });
+    }
+    unlink(path);
+    loadSceneFile(nullptr);
+    initScene(1);
+}
+
+// ------------------- Frame Encoding -------------------
+// The frame writer's conversions on a day frame, and whole frames rendered
+// and queued to a Y4M writer on /dev/null, which should cost little more
+// than rendering alone.
+void benchEncode() {
+    initScene(1);
+    for (int i = 0; i < 5; i++) { display(); stepSimulation(); }
+    static vector<unsigned char> encoded;
+    encoded.resize((size_t)frame.width * frame.height * 3);
+    double pixels = (double)frame.width * frame.height;
+    runCase("encode/rgb24", pixels, 0, [] { rgbaToRGB24(frame.pixels.data(), frame.width, frame.height, encoded.data()); });
+    runCase("encode/yuv420", pixels, 0, [] {
+        size_t luma = (size_t)frame.width * frame.height, chroma = (size_t)((frame.width + 1) / 2) * ((frame.height + 1) / 2);
+        rgbaToYUV420(frame.pixels.data(), frame.width, frame.height, encoded.data(), encoded.data() + luma, encoded.data() + luma + chroma);
+    });
+
+    static FrameWriter writer;
+    if (!writer.open(FRAME_Y4M, "/dev/null", frame.width, frame.height, 1000, TICK_MS)) return;
+    runCase("encode/day/y4m_writer", pixels, 0, [] {
+        display();
+        memcpy(writer.acquireSlot(), frame.pixels.data(), frame.pixels.size() * sizeof(uint32_t));
+        writer.submitSlot();
+        stepSimulation();
+    });
+    writer.close();
+    writer.printCounters(stderr);
+}
+
+// ------------------- GL Submission -------------------
+// The two GL targets, drawing into an offscreen pbuffer (Mesa's llvmpipe
+// on a machine without a GPU): one glBegin/glEnd per pixel or span against
+// one vertex array per frame. Each also reports how many pixels of its
+// image differ from the framebuffer target's image of the same frame.
+#ifdef PARK_BENCH_EGL
+bool createGLContext(int w, int h) {
+    EGLDisplay candidates[2] = { EGL_NO_DISPLAY, EGL_NO_DISPLAY };
+#ifdef EGL_PLATFORM_SURFACELESS_MESA
+    auto getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay) candidates[0] = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+#endif
+    candidates[1] = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    for (EGLDisplay dpy : candidates) {
+        EGLint major, minor;
+        if (dpy == EGL_NO_DISPLAY || !eglInitialize(dpy, &major, &minor)) continue;
+        const EGLint configAttribs[] = {
+            EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+            EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_NONE
+        };
+        const EGLint surfaceAttribs[] = { EGL_WIDTH, w, EGL_HEIGHT, h, EGL_NONE };
+        EGLConfig config;
+        EGLint count = 0;
+        if (!eglChooseConfig(dpy, configAttribs, &config, 1, &count) || count == 0) continue;
+        EGLSurface surface = eglCreatePbufferSurface(dpy, config, surfaceAttribs);
+        if (surface == EGL_NO_SURFACE || !eglBindAPI(EGL_OPENGL_API)) continue;
+        EGLContext ctx = eglCreateContext(dpy, config, EGL_NO_CONTEXT, nullptr);
+        if (ctx != EGL_NO_CONTEXT && eglMakeCurrent(dpy, surface, surface, ctx)) return true;
+    }
+    return false;
+}
+#endif
+
+// Resets the scene and advances it a few frames on the current target.
+void warmUpScene(bool night) {
+    initScene(1);
+    if (night) keyboard('n', 0, 0);
+    for (int i = 0; i < 5; i++) { display(); stepSimulation(); }
+}
+
+long countDifferingPixels(const Framebuffer& reference) {
+    vector<uint32_t> pixels((size_t)SCENE_W * SCENE_H);
+    glReadPixels(0, 0, SCENE_W, SCENE_H, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+    long differing = 0;
+    for (size_t i = 0; i < pixels.size(); i++) differing += ((pixels[i] ^ reference.pixels[i]) & 0xFFFFFF) != 0;
+    return differing;
+}
+
+void benchGL() {
+#ifdef PARK_BENCH_EGL
+    if (!createGLContext(SCENE_W, SCENE_H)) {
+        cerr << "No offscreen GL context, skipping gl/ cases" << endl;
+        return;
+    }
+    RenderTarget savedTarget = renderTarget;
+    bool savedHeadless = headless;
+    headless = false;
+    init();
+    for (bool night : { false, true }) {
+        renderTarget = TARGET_FRAMEBUFFER;
+        headless = true;
+        warmUpScene(night);
+        display();
+        Framebuffer reference = frame;
+        headless = false;
+        for (RenderTarget target : { TARGET_GL_POINTS, TARGET_GL_BATCHED }) {
+            renderTarget = target;
+            reshape(SCENE_W, SCENE_H);
+            warmUpScene(night);
+            long before = glDrawCalls;
+            display();
+            glFinish();
+            long calls = glDrawCalls - before;
+            long differing = countDifferingPixels(reference);
+            string name = string("gl/") + (night ? "night" : "day") +
+                          (target == TARGET_GL_POINTS ? "/immediate" : "/batched");
+            runCase(name, (double)SCENE_W * SCENE_H, 0, [] { display(); glFinish(); stepSimulation(); });
+            results.back().drawCalls = calls;
+            results.back().differing = differing;
+            cerr << "  " << calls << " draw calls per frame, " << differing << " pixels differ from --framebuffer" << endl;
+        }
+    }
+    renderTarget = savedTarget;
+    headless = savedHeadless;
+    initScene(1);
+#else
+    cerr << "Built without EGL, skipping gl/ cases" << endl;
+#endif
+}
+
+// ------------------- Output -------------------
+// One case per line, fields in a fixed order, so two runs diff cleanly.
+bool writeJson(const string& path) {
+    ostringstream os;
+    os << "{\n  \"kernels\": \"" << spanKernels->name << "\",\n  \"threads\": " << rasterThreads
+       << ",\n  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& r = results[i];
+        bool isFrame = r.name.compare(0, 6, "frame/") == 0 || r.name.compare(0, 3, "gl/") == 0;
+        os << "    {\"name\": \"" << r.name << "\", \"p50_ns\": " << r.p50 << ", \"p90_ns\": " << r.p90
+           << ", \"p99_ns\": " << r.p99;
+        if (isFrame) os << ", \"fps\": " << 1e9 / r.p50;
+        if (r.drawCalls >= 0) os << ", \"draw_calls\": " << r.drawCalls;
+        if (r.differing >= 0) os << ", \"pixels_differing\": " << r.differing;
+        else {
+            if (r.pixelsPerOp > 0) os << ", \"ns_per_pixel\": " << r.p50 / r.pixelsPerOp;
+            if (r.spansPerOp > 0) os << ", \"spans_per_s\": " << r.spansPerOp * 1e9 / r.p50;
+        }
+        os << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    os << "  ]\n}\n";
+    if (path == "-") { cout << os.str(); return true; }
+    ofstream f(path);
+    f << os.str();
+    return (bool)f;
+}
+
+// Reads name -> p50 back from a file written by writeJson.
+map<string, double> readBaseline(const string& path) {
+    map<string, double> base;
+    ifstream f(path);
+    string line;
+    while (getline(f, line)) {
+        size_t n = line.find("\"name\": \""), p = line.find("\"p50_ns\": ");
+        if (n == string::npos || p == string::npos) continue;
+        n += 9;
+        base[line.substr(n, line.find('"', n) - n)] = atof(line.c_str() + p + 10);
+    }
+    return base;
+}
+
+int compareBaseline(const string& path, double tolerance) {
+    map<string, double> base = readBaseline(path);
+    if (base.empty()) {
+        cerr << "No results found in baseline " << path << endl;
+        return 1;
+    }
+    int regressions = 0;
+    for (const BenchResult& r : results) {
+        auto it = base.find(r.name);
+        if (it == base.end()) continue;
+        double change = (r.p50 - it->second) / it->second * 100.0;
+        bool slower = change > tolerance;
+        regressions += slower;
+        fprintf(stderr, "%-40s %12.1f -> %12.1f ns  %+7.1f%%%s\n", r.name.c_str(), it->second, r.p50, change,
+                slower ? "  REGRESSION" : "");
+    }
+    return regressions ? 1 : 0;
+}
+
+// ------------------- Main -------------------
+int main(int argc, char** argv) {
+    selectSpanKernels();
+    string out = "-", baseline, filter;
+    double tolerance = 10.0;
+    for (int i = 1; i < argc; i++) {
+        const char* v;
+        if ((v = optionValue(argc, argv, i, "--out"))) out = v;
+        else if ((v = optionValue(argc, argv, i, "--baseline"))) baseline = v;
+        else if ((v = optionValue(argc, argv, i, "--tolerance"))) tolerance = atof(v);
+        else if ((v = optionValue(argc, argv, i, "--samples"))) sampleCount = max(1, atoi(v));
+        else if ((v = optionValue(argc, argv, i, "--filter"))) filter = v;
+        else if ((v = optionValue(argc, argv, i, "--threads"))) rasterThreads = max(0, atoi(v));
+        else if ((v = optionValue(argc, argv, i, "--simd")) && !selectSpanKernels(v))
+            cerr << "Unknown or unsupported --simd kernel set, using " << spanKernels->name << endl;
+    }
+
+    // memory framebuffer, no GL context
+    headless = true;
+    renderTarget = TARGET_FRAMEBUFFER;
+    initScene(1);
+    frame.clear(packColor(0.5f, 0.8f, 1.0f, 1.0f));
+
+    auto selected = [&filter](const char* group) { return filter.empty() || filter.find(group) != string::npos; };
+    if (selected("line")) benchLines();
+    if (selected("circle")) benchCircles();
+    if (selected("polygon")) benchPolygons();
+    if (selected("sprite")) benchSprites();
+    if (selected("frame")) benchFrames();
+    if (selected("scene")) benchScenes();
+    if (selected("encode")) benchEncode();
+    if (selected("gl")) benchGL();
+
+    if (!writeJson(out)) {
+        cerr << "Failed to write " << out << endl;
+        return 1;
+    }
+    return baseline.empty() ? 0 : compareBaseline(baseline, tolerance);
+}
@@ -1,12 +1,34 @@
 
 // CinematicStation.cpp
-// COMPILE: g++ CinematicStation_ManualTF.cpp -lGL -lGLU -lglut -o CinematicStation
+// COMPILE: g++ -pthread 3d_scene_CinematicStation.cpp -lGL -lGLU -lglut -lEGL -o CinematicStation
 
+#define GL_GLEXT_PROTOTYPES
 #include <GL/glut.h>
+#include <GL/glext.h>
+#include <cassert>
 #include <cmath>
 #include <vector>
 #include <cstdlib>
 #include <ctime>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <sys/stat.h>
+#include "frame_writer.h"
+#include "shm_frame_sink.h"
+#include "trace_events.h"
+#include "perf_counters.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define STATION_X86_SIMD 1
+#endif
+
+#if defined(__linux__)
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#define STATION_HEADLESS_EGL 1
+#endif
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846f
@@ -31,7 +53,19 @@ struct Vec3 {
     }
 };
 
-struct Matrix4 {
+// Column-major 4x4 product out = a * b. Every kernel sums the four terms
+// of an element in the same order (k = 0..3, no fused multiply-add), so
+// they give bit-identical results; the vector kernels read all of `a`
+// before writing and each column of `b` before writing that column, so
+// `out` may alias either operand.
+struct Matrix4;
+void mat4MultiplyScalar(const Matrix4& a, const Matrix4& b, Matrix4& out);
+#ifdef STATION_X86_SIMD
+void mat4MultiplySSE(const Matrix4& a, const Matrix4& b, Matrix4& out);
+void mat4MultiplyAVX(const Matrix4& a, const Matrix4& b, Matrix4& out);
+#endif
+
+struct alignas(32) Matrix4 {
     float m[16]; // Column-major order for OpenGL
 
     Matrix4() { loadIdentity(); }
@@ -74,28 +108,171 @@ struct Matrix4 {
 
     Matrix4 operator*(const Matrix4& other) const {
         Matrix4 result;
-        for (int i = 0; i < 4; ++i) {
-            for (int j = 0; j < 4; ++j) {
-                float sum = 0.0f;
-                for (int k = 0; k < 4; ++k) {
-                    sum += m[j + k * 4] * other.m[i * 4 + k];
-                }
-                result.m[j + i * 4] = sum;
-            }
-        }
+#if defined(STATION_X86_SIMD) && defined(__AVX__)
+        mat4MultiplyAVX(*this, other, result);
+#elif defined(STATION_X86_SIMD)
+        mat4MultiplySSE(*this, other, result);
+#else
+        mat4MultiplyScalar(*this, other, result);
+#endif
         return result;
     }
+
+    // In-place right multiplication by an affine factor:
+    // translate(x, y, z) is *this = *this * createTranslation(x, y, z), and
+    // so on. Only the columns the factor changes are recomputed (one for a
+    // translation, three scaled columns for a scale, three for a
+    // rotation), with the terms in the same order as operator*, so the
+    // result equals the full product up to the sign of zero terms.
+    void translate(float x, float y, float z) {
+#ifdef STATION_X86_SIMD
+        __m128 r = _mm_mul_ps(_mm_load_ps(m), _mm_set1_ps(x));
+        r = _mm_add_ps(r, _mm_mul_ps(_mm_load_ps(m + 4), _mm_set1_ps(y)));
+        r = _mm_add_ps(r, _mm_mul_ps(_mm_load_ps(m + 8), _mm_set1_ps(z)));
+        _mm_store_ps(m + 12, _mm_add_ps(r, _mm_load_ps(m + 12)));
+#else
+        for (int j = 0; j < 4; ++j) m[12 + j] = m[j] * x + m[4 + j] * y + m[8 + j] * z + m[12 + j];
+#endif
+    }
+
+    void scale(float sx, float sy, float sz) {
+#ifdef STATION_X86_SIMD
+        _mm_store_ps(m, _mm_mul_ps(_mm_load_ps(m), _mm_set1_ps(sx)));
+        _mm_store_ps(m + 4, _mm_mul_ps(_mm_load_ps(m + 4), _mm_set1_ps(sy)));
+        _mm_store_ps(m + 8, _mm_mul_ps(_mm_load_ps(m + 8), _mm_set1_ps(sz)));
+#else
+        for (int j = 0; j < 4; ++j) { m[j] *= sx; m[4 + j] *= sy; m[8 + j] *= sz; }
+#endif
+    }
+
+    void rotate(float angle, float x, float y, float z) {
+        Matrix4 r = createRotation(angle, x, y, z);
+#ifdef STATION_X86_SIMD
+        __m128 c0 = _mm_load_ps(m), c1 = _mm_load_ps(m + 4), c2 = _mm_load_ps(m + 8);
+        for (int i = 0; i < 3; ++i) {
+            __m128 col = _mm_mul_ps(c0, _mm_set1_ps(r.m[i * 4]));
+            col = _mm_add_ps(col, _mm_mul_ps(c1, _mm_set1_ps(r.m[i * 4 + 1])));
+            col = _mm_add_ps(col, _mm_mul_ps(c2, _mm_set1_ps(r.m[i * 4 + 2])));
+            _mm_store_ps(m + i * 4, col);
+        }
+#else
+        float c[12];
+        memcpy(c, m, sizeof(c));
+        for (int i = 0; i < 3; ++i)
+            for (int j = 0; j < 4; ++j)
+                m[i * 4 + j] = c[j] * r.m[i * 4] + c[4 + j] * r.m[i * 4 + 1] + c[8 + j] * r.m[i * 4 + 2];
+#endif
+    }
 };
 
-Matrix4 modelViewMatrix;
-std::vector<Matrix4> matrixStack;
+// The original triple loop, kept as the portable kernel and as the
+// reference the benchmark compares the others against.
+inline void mat4MultiplyScalar(const Matrix4& a, const Matrix4& b, Matrix4& out) {
+    for (int i = 0; i < 4; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            float sum = 0.0f;
+            for (int k = 0; k < 4; ++k) {
+                sum += a.m[j + k * 4] * b.m[i * 4 + k];
+            }
+            out.m[j + i * 4] = sum;
+        }
+    }
+}
+
+#ifdef STATION_X86_SIMD
+// One result column per iteration: the columns of `a` weighted by the four
+// elements of a column of `b`.
+inline void mat4MultiplySSE(const Matrix4& a, const Matrix4& b, Matrix4& out) {
+    __m128 c0 = _mm_load_ps(a.m), c1 = _mm_load_ps(a.m + 4), c2 = _mm_load_ps(a.m + 8), c3 = _mm_load_ps(a.m + 12);
+    for (int i = 0; i < 4; ++i) {
+        const float* bc = b.m + i * 4;
+        __m128 r = _mm_mul_ps(c0, _mm_set1_ps(bc[0]));
+        r = _mm_add_ps(r, _mm_mul_ps(c1, _mm_set1_ps(bc[1])));
+        r = _mm_add_ps(r, _mm_mul_ps(c2, _mm_set1_ps(bc[2])));
+        r = _mm_add_ps(r, _mm_mul_ps(c3, _mm_set1_ps(bc[3])));
+        _mm_store_ps(out.m + i * 4, r);
+    }
+}
+
+// Two result columns per iteration: each column of `a` is repeated in
+// both 128-bit lanes, and an in-lane shuffle broadcasts element k of two
+// columns of `b` at once. Used by operator* when built with -mavx; the
+// benchmark runs it wherever the CPU has AVX.
+__attribute__((target("avx"))) inline void mat4MultiplyAVX(const Matrix4& a, const Matrix4& b, Matrix4& out) {
+    __m256 c0 = _mm256_broadcast_ps((const __m128*)a.m), c1 = _mm256_broadcast_ps((const __m128*)(a.m + 4));
+    __m256 c2 = _mm256_broadcast_ps((const __m128*)(a.m + 8)), c3 = _mm256_broadcast_ps((const __m128*)(a.m + 12));
+    for (int i = 0; i < 4; i += 2) {
+        __m256 bc = _mm256_load_ps(b.m + i * 4);
+        __m256 r = _mm256_mul_ps(c0, _mm256_shuffle_ps(bc, bc, 0x00));
+        r = _mm256_add_ps(r, _mm256_mul_ps(c1, _mm256_shuffle_ps(bc, bc, 0x55)));
+        r = _mm256_add_ps(r, _mm256_mul_ps(c2, _mm256_shuffle_ps(bc, bc, 0xAA)));
+        r = _mm256_add_ps(r, _mm256_mul_ps(c3, _mm256_shuffle_ps(bc, bc, 0xFF)));
+        _mm256_store_ps(out.m + i * 4, r);
+    }
+}
+#endif
+
+// With --perf these stages count cycles, instructions, cache and branch
+// misses (see perf_counters.h), reported per unit at exit. Only the render
+// thread is counted; the GL driver's own threads are not. "frame other" is
+// the rest of renderScene.
+PerfStage perfMatrixStack("matrix stack", "op");
+PerfStage perfParticles("particle update", "particle");
+PerfStage perfGeometry("geometry", "object");
+PerfStage perfFrameOther("frame other", "frame");
+
+// Modelview matrix stack, replacing glPushMatrix/glPopMatrix. The levels
+// live inline in the object (no allocation), and draw functions take the
+// stack as a parameter instead of sharing a global current matrix, so any
+// number of stacks can be in use at once, one per thread. Nesting deeper
+// than MATRIX_STACK_DEPTH or popping the last level is a bug, caught by
+// assert() in builds without NDEBUG.
+const int MATRIX_STACK_DEPTH = 16;
+
+class MatrixStack {
+public:
+    Matrix4& top() { return levels[depth]; }
+    const Matrix4& top() const { return levels[depth]; }
+    int size() const { return depth + 1; }
+
+    void push() {
+        PERF_SCOPE(perfMatrixStack, 1);
+        assert(depth + 1 < MATRIX_STACK_DEPTH && "matrix stack overflow");
+        levels[depth + 1] = levels[depth];
+        depth++;
+    }
+    void pop() {
+        PERF_SCOPE(perfMatrixStack, 1);
+        assert(depth > 0 && "matrix stack underflow");
+        depth--;
+    }
+
+    void load(const Matrix4& m) { levels[depth] = m; }
+    void loadIdentity() { PERF_SCOPE(perfMatrixStack, 1); levels[depth].loadIdentity(); }
+    void translate(float x, float y, float z) { PERF_SCOPE(perfMatrixStack, 1); levels[depth].translate(x, y, z); }
+    void rotate(float angle, float x, float y, float z) { PERF_SCOPE(perfMatrixStack, 1); levels[depth].rotate(angle, x, y, z); }
+    void scale(float sx, float sy, float sz) { PERF_SCOPE(perfMatrixStack, 1); levels[depth].scale(sx, sy, sz); }
+
+    // Hands the current matrix to GL for the next draw call.
+    void upload() const { glLoadMatrixf(levels[depth].m); }
+
+private:
+    Matrix4 levels[MATRIX_STACK_DEPTH];
+    int depth = 0;
+};
 
-void custom_push_matrix() { matrixStack.push_back(modelViewMatrix); }
-void custom_pop_matrix() { modelViewMatrix = matrixStack.back(); matrixStack.pop_back(); }
-void custom_load_identity() { modelViewMatrix.loadIdentity(); }
-void custom_translate(float x, float y, float z) { modelViewMatrix = modelViewMatrix * Matrix4::createTranslation(x, y, z); }
-void custom_rotate(float angle, float x, float y, float z) { modelViewMatrix = modelViewMatrix * Matrix4::createRotation(angle, x, y, z); }
-void custom_scale(float sx, float sy, float sz) { modelViewMatrix = modelViewMatrix * Matrix4::createScale(sx, sy, sz); }
+// Pushes on construction and pops on destruction, so every exit from a
+// scope leaves the stack as it found it.
+class MatrixScope {
+public:
+    explicit MatrixScope(MatrixStack& s) : stack(s) { stack.push(); }
+    ~MatrixScope() { stack.pop(); }
+    MatrixScope(const MatrixScope&) = delete;
+    MatrixScope& operator=(const MatrixScope&) = delete;
+
+private:
+    MatrixStack& stack;
+};
 
 Matrix4 custom_look_at(const Vec3& eye, const Vec3& center, const Vec3& up) {
     Vec3 f = (center - eye).normalize();
@@ -141,31 +318,601 @@ void setMaterial(const float ambient[4], const float diffuse[4], const float spe
     glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, shininess);
 }
 
+struct Material { float ambient[4], diffuse[4], specular[4], shininess; };
+
+void setMaterial(const Material& m) { setMaterial(m.ambient, m.diffuse, m.specular, m.shininess); }
+
+const Material GROUND_MATERIAL = { { 0.08f, 0.25f, 0.08f, 1.0f }, { 0.12f, 0.45f, 0.12f, 1.0f }, { 0.02f, 0.02f, 0.02f, 1.0f }, 5.0f };
+const Material RAIL_MATERIAL = { { 0.1f, 0.1f, 0.1f, 1.0f }, { 0.3f, 0.3f, 0.3f, 1.0f }, { 0.8f, 0.8f, 0.8f, 1.0f }, 100.0f };
+const Material SLEEPER_MATERIAL = { { 0.1f, 0.05f, 0.02f, 1.0f }, { 0.36f, 0.22f, 0.12f, 1.0f }, { 0.05f, 0.05f, 0.05f, 1.0f }, 10.0f };
+// Also what the sign, trees, passengers and train are lit with.
+const Material PLATFORM_MATERIAL = { { 0.18f, 0.18f, 0.18f, 1.0f }, { 0.6f, 0.6f, 0.6f, 1.0f }, { 0.1f, 0.1f, 0.1f, 1.0f }, 10.0f };
+
+// Feature checks against the current context.
+bool glVersionAtLeast(int major, int minor) {
+    const char* version = (const char*)glGetString(GL_VERSION);
+    int ma = 0, mi = 0;
+    if (!version || sscanf(version, "%d.%d", &ma, &mi) != 2) return false;
+    return ma > major || (ma == major && mi >= minor);
+}
+
+bool glHasExtension(const char* name) {
+    const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+    return extensions && strstr(extensions, name);
+}
+
+long glDrawCalls = 0;   // glBegin/glEnd pairs and glDrawArrays calls issued so far
+
+// ---------- Mesh Cache ----------
+// Unit cube, sphere and cylinder, tessellated once per (shape, slices,
+// stacks) into interleaved position/normal triangles and kept in a vertex
+// buffer object (client-side arrays on GL without buffer objects, or with
+// --no-vbo). Draws scale the unit mesh through the matrix stack;
+// GL_NORMALIZE keeps the lighting right. Shapes and orientation match
+// glutSolidCube, glutSolidSphere and gluCylinder, which need a GLUT window
+// or a new quadric per call. buildMeshes fills the cache in initScene;
+// after that drawing only looks meshes up, so the cache is read-only while
+// frames render and can be shared by any number of matrix stacks. It is
+// passed to the draw functions alongside the stack.
+enum MeshShape { MESH_CUBE, MESH_SPHERE, MESH_CYLINDER };
+
+struct Mesh {
+    std::vector<float> vertices;   // px, py, pz, nx, ny, nz per vertex
+    GLsizei count = 0;
+    GLuint vbo = 0;
+};
+
+const int MESH_STRIDE = 6 * sizeof(float);
+
+class MeshCache {
+public:
+    bool useBuffers = true;   // cleared by --no-vbo or when GL has no buffer objects
+
+    // Tessellates and uploads one mesh, once; needs a current context.
+    void build(MeshShape shape, int slices = 0, int stacks = 0) {
+        if (meshes.count(key(shape, slices, stacks))) return;
+        TRACE_SCOPE("tessellate");
+        Mesh& mesh = meshes[key(shape, slices, stacks)];
+        if (shape == MESH_CUBE) tessellateCube(mesh.vertices);
+        else if (shape == MESH_SPHERE) tessellateSphere(mesh.vertices, slices, stacks);
+        else tessellateCylinder(mesh.vertices, slices);
+        mesh.count = (GLsizei)(mesh.vertices.size() / 6);
+        if (buffersEnabled()) {
+            glGenBuffers(1, &mesh.vbo);
+            glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+            glBufferData(GL_ARRAY_BUFFER, mesh.vertices.size() * sizeof(float), mesh.vertices.data(), GL_STATIC_DRAW);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+        }
+    }
+
+    // A mesh built by build(); a missing one is a bug, caught by assert().
+    const Mesh& get(MeshShape shape, int slices = 0, int stacks = 0) const {
+        auto it = meshes.find(key(shape, slices, stacks));
+        assert(it != meshes.end() && "mesh not built by buildMeshes");
+        return it->second;
+    }
+
+    // Buffer objects are core in GL 1.5.
+    bool buffersEnabled() const {
+        return useBuffers && (glVersionAtLeast(1, 5) || glHasExtension("GL_ARB_vertex_buffer_object"));
+    }
+
+    // Points the vertex and normal arrays at the mesh.
+    void bind(const Mesh& mesh) const {
+        const float* base = nullptr;
+        if (mesh.vbo) glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+        else base = mesh.vertices.data();
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glEnableClientState(GL_NORMAL_ARRAY);
+        glVertexPointer(3, GL_FLOAT, MESH_STRIDE, base);
+        glNormalPointer(GL_FLOAT, MESH_STRIDE, base + 3);
+        if (mesh.vbo) glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    void unbind() const {
+        glDisableClientState(GL_NORMAL_ARRAY);
+        glDisableClientState(GL_VERTEX_ARRAY);
+    }
+
+    void draw(const Mesh& mesh) const {
+        PERF_SCOPE(perfGeometry, 1);
+        bind(mesh);
+        glDrawCalls++;
+        glDrawArrays(GL_TRIANGLES, 0, mesh.count);
+        unbind();
+    }
+
+    // Needs the context the buffers were created in to be current.
+    void clear() {
+        for (auto& entry : meshes)
+            if (entry.second.vbo) glDeleteBuffers(1, &entry.second.vbo);
+        meshes.clear();
+    }
+
+private:
+    std::map<int, Mesh> meshes;
+
+    static int key(MeshShape shape, int slices, int stacks) { return (shape << 20) | (slices << 10) | stacks; }
+
+    static void vertex(std::vector<float>& out, float px, float py, float pz, float nx, float ny, float nz) {
+        float v[6] = { px, py, pz, nx, ny, nz };
+        out.insert(out.end(), v, v + 6);
+    }
+
+    static void tessellateCube(std::vector<float>& out) {
+        static const float normals[6][3] = {
+            { 1, 0, 0 }, { -1, 0, 0 }, { 0, 1, 0 }, { 0, -1, 0 }, { 0, 0, 1 }, { 0, 0, -1 }
+        };
+        static const float corners[6][4][3] = {
+            { { 1,-1,-1 }, { 1, 1,-1 }, { 1, 1, 1 }, { 1,-1, 1 } },
+            { {-1,-1, 1 }, {-1, 1, 1 }, {-1, 1,-1 }, {-1,-1,-1 } },
+            { {-1, 1,-1 }, {-1, 1, 1 }, { 1, 1, 1 }, { 1, 1,-1 } },
+            { {-1,-1,-1 }, { 1,-1,-1 }, { 1,-1, 1 }, {-1,-1, 1 } },
+            { {-1,-1, 1 }, { 1,-1, 1 }, { 1, 1, 1 }, {-1, 1, 1 } },
+            { {-1, 1,-1 }, { 1, 1,-1 }, { 1,-1,-1 }, {-1,-1,-1 } }
+        };
+        static const int quad[6] = { 0, 1, 2, 0, 2, 3 };
+        for (int f = 0; f < 6; ++f)
+            for (int v : quad)
+                vertex(out, corners[f][v][0] * 0.5f, corners[f][v][1] * 0.5f, corners[f][v][2] * 0.5f,
+                       normals[f][0], normals[f][1], normals[f][2]);
+    }
+
+    // Slices around the z axis, stacks from -z to +z, like glutSolidSphere.
+    static void tessellateSphere(std::vector<float>& out, int slices, int stacks) {
+        for (int i = 0; i < stacks; ++i) {
+            float phi0 = M_PI * i / stacks - M_PI / 2.0f;
+            float phi1 = M_PI * (i + 1) / stacks - M_PI / 2.0f;
+            for (int j = 0; j < slices; ++j) {
+                float t0 = 2.0f * M_PI * j / slices, t1 = 2.0f * M_PI * (j + 1) / slices;
+                float p[4][3] = {
+                    { cosf(phi1) * cosf(t0), cosf(phi1) * sinf(t0), sinf(phi1) },
+                    { cosf(phi0) * cosf(t0), cosf(phi0) * sinf(t0), sinf(phi0) },
+                    { cosf(phi1) * cosf(t1), cosf(phi1) * sinf(t1), sinf(phi1) },
+                    { cosf(phi0) * cosf(t1), cosf(phi0) * sinf(t1), sinf(phi0) },
+                };
+                for (int v : { 0, 1, 2, 1, 3, 2 }) vertex(out, p[v][0], p[v][1], p[v][2], p[v][0], p[v][1], p[v][2]);
+            }
+        }
+    }
+
+    // Side wall only, z from 0 to 1, one stack, like gluCylinder.
+    static void tessellateCylinder(std::vector<float>& out, int slices) {
+        for (int j = 0; j < slices; ++j) {
+            float a0 = 2.0f * M_PI * j / slices, a1 = 2.0f * M_PI * (j + 1) / slices;
+            float s0 = sinf(a0), c0 = cosf(a0), s1 = sinf(a1), c1 = cosf(a1);
+            vertex(out, s0, c0, 0.0f, s0, c0, 0.0f);
+            vertex(out, s1, c1, 0.0f, s1, c1, 0.0f);
+            vertex(out, s0, c0, 1.0f, s0, c0, 0.0f);
+            vertex(out, s1, c1, 0.0f, s1, c1, 0.0f);
+            vertex(out, s1, c1, 1.0f, s1, c1, 0.0f);
+            vertex(out, s0, c0, 1.0f, s0, c0, 0.0f);
+        }
+    }
+};
+
+MeshCache meshCache;
+
+// Every mesh the station draws, at the detail each caller asks for.
+void buildMeshes(MeshCache& meshes) {
+    meshes.build(MESH_CUBE);
+    meshes.build(MESH_CYLINDER, 12);     // engine chimney
+    meshes.build(MESH_SPHERE, 24, 12);   // hills
+    meshes.build(MESH_SPHERE, 18, 10);   // tree crowns
+    meshes.build(MESH_SPHERE, 16, 8);    // shadows
+    meshes.build(MESH_SPHERE, 12, 8);    // smoke
+    meshes.build(MESH_SPHERE, 8, 6);     // passenger heads
+}
+
 // Draw functions now use custom transforms
-void drawBox(float sx, float sy, float sz) {
-    custom_push_matrix();
-    custom_scale(sx, sy, sz);
-    glLoadMatrixf(modelViewMatrix.m);
-    glutSolidCube(1.0f);
-    custom_pop_matrix();
+void drawBox(MatrixStack& ms, const MeshCache& meshes, float sx, float sy, float sz) {
+    MatrixScope scope(ms);
+    ms.scale(sx, sy, sz);
+    ms.upload();
+    meshes.draw(meshes.get(MESH_CUBE));
 }
 
-void drawCylinder(float radius, float height, int slices = 16) {
-    GLUquadric* q = gluNewQuadric();
-    gluQuadricNormals(q, GLU_SMOOTH);
-    gluCylinder(q, radius, radius, height, slices, 1);
-    gluDeleteQuadric(q);
+void solidSphere(MatrixStack& ms, const MeshCache& meshes, float radius, int slices, int stacks) {
+    MatrixScope scope(ms);
+    ms.scale(radius, radius, radius);
+    ms.upload();
+    meshes.draw(meshes.get(MESH_SPHERE, slices, stacks));
 }
 
-void drawShadow(float radius) {
-    custom_push_matrix();
+void drawCylinder(MatrixStack& ms, const MeshCache& meshes, float radius, float height, int slices) {
+    MatrixScope scope(ms);
+    ms.scale(radius, radius, height);
+    ms.upload();
+    meshes.draw(meshes.get(MESH_CYLINDER, slices));
+}
+
+void drawShadow(MatrixStack& ms, const MeshCache& meshes, float radius) {
+    MatrixScope scope(ms);
     glColor4f(0.0f, 0.0f, 0.0f, 0.4f);
-    custom_scale(1.0f, 0.01f, 1.0f);
-    glLoadMatrixf(modelViewMatrix.m);
-    glutSolidSphere(radius, 16, 8);
-    custom_pop_matrix();
+    ms.scale(1.0f, 0.01f, 1.0f);
+    solidSphere(ms, meshes, radius, 16, 8);
+}
+
+// ---------- Instancing ----------
+// Small moving objects repeated many times per frame (coach windows and
+// passenger parts) are collected into one batch per mesh, each instance a
+// modelview, its normal matrix and a colour, and each batch is drawn with
+// one call. With GL 3.3 (or the instanced-array extensions)
+// that is glDrawArraysInstanced and a vertex shader that reads the
+// per-instance attributes and repeats the fixed-function lighting for the
+// scene's single positional light; fog and the rest of the fragment stage
+// stay fixed-function. Otherwise, or with --no-instancing, the instances
+// are pre-transformed into eye space on the CPU and drawn as one vertex
+// stream under an identity modelview. A batch is drawn with the material
+// and lighting state current when it is flushed. The renderer holds GL
+// objects and scratch space, so each thread drawing with its own context
+// and matrix stack also owns its own InstanceRenderer and SceneInstances,
+// passed down like the stack; only the mesh cache is shared.
+const int INSTANCE_FLOATS = 16 + 9 + 4;   // modelview, normal matrix, RGBA
+const int STREAM_FLOATS = 3 + 3 + 4;      // eye-space position, normal, RGBA
+
+// The inverse transpose of the upper 3x3 of a column-major 4x4, whose
+// columns are the cross products of the matrix columns over the
+// determinant.
+void normalMatrix(const float m[16], float out[9]) {
+    Vec3 c0(m[0], m[1], m[2]), c1(m[4], m[5], m[6]), c2(m[8], m[9], m[10]);
+    Vec3 n0 = c1.cross(c2), n1 = c2.cross(c0), n2 = c0.cross(c1);
+    float det = c0.x * n0.x + c0.y * n0.y + c0.z * n0.z;
+    float inv = det != 0.0f ? 1.0f / det : 0.0f;
+    float n[9] = { n0.x * inv, n0.y * inv, n0.z * inv, n1.x * inv, n1.y * inv, n1.z * inv,
+                   n2.x * inv, n2.y * inv, n2.z * inv };
+    memcpy(out, n, sizeof(n));
 }
 
+// Writes the mesh transformed by m (normals by its normal matrix n) with
+// one colour as STREAM_FLOATS per vertex; returns the end of the output.
+float* transformMesh(const Mesh& mesh, const float m[16], const float n[9], const float color[4], float* out) {
+    const float* v = mesh.vertices.data();
+    for (GLsizei i = 0; i < mesh.count; ++i, v += 6, out += STREAM_FLOATS) {
+        for (int r = 0; r < 3; ++r) {
+            out[r] = m[r] * v[0] + m[4 + r] * v[1] + m[8 + r] * v[2] + m[12 + r];
+            out[3 + r] = n[r] * v[3] + n[3 + r] * v[4] + n[6 + r] * v[5];
+        }
+        memcpy(out + 6, color, 4 * sizeof(float));
+    }
+    return out;
+}
+
+// Vertex, normal and colour arrays over a STREAM_FLOATS layout starting at
+// base (a client pointer, or an offset into the bound buffer).
+void enableStreamArrays(const float* base) {
+    const GLsizei stride = STREAM_FLOATS * sizeof(float);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glVertexPointer(3, GL_FLOAT, stride, base);
+    glNormalPointer(GL_FLOAT, stride, base + 3);
+    glColorPointer(4, GL_FLOAT, stride, base + 6);
+}
+
+void disableStreamArrays() {
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+}
+
+class InstanceRenderer {
+public:
+    bool useInstancing = true;   // cleared by --no-instancing
+
+    void draw(const MeshCache& meshes, const Mesh& mesh, const std::vector<float>& instances) {
+        GLsizei count = (GLsizei)(instances.size() / INSTANCE_FLOATS);
+        if (!count) return;
+        PERF_SCOPE(perfGeometry, count);
+        if (useInstancing && ready()) drawInstanced(meshes, mesh, instances, count);
+        else drawStream(mesh, instances, count);
+    }
+
+    // Needs the context the program and buffer were created in to be
+    // current.
+    void clear() {
+        if (program) glDeleteProgram(program);
+        if (buffer) glDeleteBuffers(1, &buffer);
+        program = 0;
+        buffer = 0;
+        state = UNTRIED;
+    }
+
+private:
+    enum { UNTRIED, READY, UNAVAILABLE } state = UNTRIED;
+    GLuint program = 0, buffer = 0;
+    GLint litLocation = -1;
+    std::vector<float> stream;
+
+    // Instance attributes: modelview columns at 1-4, normal matrix columns
+    // at 5-7, colour at 8 (0 aliases gl_Vertex).
+    static const char* vertexShader() {
+        return
+            "#version 120\n"
+            "attribute vec4 modelView0, modelView1, modelView2, modelView3;\n"
+            "attribute vec3 normal0, normal1, normal2;\n"
+            "attribute vec4 color;\n"
+            "uniform bool lit;\n"
+            "void main() {\n"
+            "    vec4 eye = mat4(modelView0, modelView1, modelView2, modelView3) * gl_Vertex;\n"
+            "    gl_Position = gl_ProjectionMatrix * eye;\n"
+            "    gl_FogFragCoord = abs(eye.z);\n"
+            "    vec4 c = color;\n"
+            "    if (lit) {\n"
+            "        gl_LightSourceParameters light = gl_LightSource[0];\n"
+            "        vec3 n = normalize(mat3(normal0, normal1, normal2) * gl_Normal);\n"
+            "        vec3 l = normalize(light.position.xyz - eye.xyz);\n"
+            "        float diffuse = max(dot(n, l), 0.0);\n"
+            "        vec3 rgb = (gl_LightModel.ambient.rgb + light.ambient.rgb + diffuse * light.diffuse.rgb) * c.rgb;\n"
+            "        if (diffuse > 0.0) {\n"
+            "            float specular = max(dot(n, normalize(l + vec3(0.0, 0.0, 1.0))), 0.0);\n"
+            "            rgb += pow(specular, gl_FrontMaterial.shininess) * light.specular.rgb * gl_FrontMaterial.specular.rgb;\n"
+            "        }\n"
+            "        c = vec4(clamp(rgb, 0.0, 1.0), c.a);\n"
+            "    }\n"
+            "    gl_FrontColor = c;\n"
+            "    gl_BackColor = c;\n"
+            "}\n";
+    }
+
+    bool ready() {
+        if (state == UNTRIED) state = init() ? READY : UNAVAILABLE;
+        return state == READY;
+    }
+
+    bool init() {
+        bool instancedArrays = glVersionAtLeast(3, 3) ||
+            (glVersionAtLeast(2, 0) && glHasExtension("GL_ARB_instanced_arrays") && glHasExtension("GL_ARB_draw_instanced"));
+        if (!instancedArrays) return false;
+        GLuint shader = glCreateShader(GL_VERTEX_SHADER);
+        const char* source = vertexShader();
+        glShaderSource(shader, 1, &source, nullptr);
+        glCompileShader(shader);
+        program = glCreateProgram();
+        glAttachShader(program, shader);
+        const char* names[8] = { "modelView0", "modelView1", "modelView2", "modelView3", "normal0", "normal1", "normal2", "color" };
+        for (int i = 0; i < 8; ++i) glBindAttribLocation(program, i + 1, names[i]);
+        glLinkProgram(program);
+        glDeleteShader(shader);
+        GLint linked = 0;
+        glGetProgramiv(program, GL_LINK_STATUS, &linked);
+        if (!linked) {
+            char log[1024] = "";
+            glGetProgramInfoLog(program, sizeof(log), nullptr, log);
+            fprintf(stderr, "Instancing shader failed, drawing instances from a CPU stream: %s\n", log);
+            glDeleteProgram(program);
+            program = 0;
+            return false;
+        }
+        litLocation = glGetUniformLocation(program, "lit");
+        glGenBuffers(1, &buffer);
+        return true;
+    }
+
+    void drawInstanced(const MeshCache& meshes, const Mesh& mesh, const std::vector<float>& instances, GLsizei count) {
+        glUseProgram(program);
+        glUniform1i(litLocation, glIsEnabled(GL_LIGHTING));
+        glBindBuffer(GL_ARRAY_BUFFER, buffer);
+        glBufferData(GL_ARRAY_BUFFER, instances.size() * sizeof(float), instances.data(), GL_STREAM_DRAW);
+        const GLsizei stride = INSTANCE_FLOATS * sizeof(float);
+        const int sizes[8] = { 4, 4, 4, 4, 3, 3, 3, 4 };
+        size_t offset = 0;
+        for (int i = 0; i < 8; ++i) {
+            glEnableVertexAttribArray(i + 1);
+            glVertexAttribPointer(i + 1, sizes[i], GL_FLOAT, GL_FALSE, stride, (const void*)(offset * sizeof(float)));
+            glVertexAttribDivisor(i + 1, 1);
+            offset += sizes[i];
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        meshes.bind(mesh);
+        glDrawCalls++;
+        glDrawArraysInstanced(GL_TRIANGLES, 0, mesh.count, count);
+        meshes.unbind();
+        for (int i = 0; i < 8; ++i) {
+            glVertexAttribDivisor(i + 1, 0);
+            glDisableVertexAttribArray(i + 1);
+        }
+        glUseProgram(0);
+    }
+
+    void drawStream(const Mesh& mesh, const std::vector<float>& instances, GLsizei count) {
+        stream.resize((size_t)count * mesh.count * STREAM_FLOATS);
+        float* out = stream.data();
+        for (GLsizei k = 0; k < count; ++k) {
+            const float* m = &instances[(size_t)k * INSTANCE_FLOATS];
+            out = transformMesh(mesh, m, m + 16, m + 25, out);
+        }
+        glLoadIdentity();
+        enableStreamArrays(stream.data());
+        glDrawCalls++;
+        glDrawArrays(GL_TRIANGLES, 0, count * mesh.count);
+        disableStreamArrays();
+    }
+};
+
+// The instances of one cached mesh collected during a frame.
+class InstanceBatch {
+public:
+    InstanceBatch(MeshShape s, int sl = 0, int st = 0) : shape(s), slices(sl), stacks(st) {}
+
+    // Adds the unit mesh under the stack's current matrix.
+    void add(const MatrixStack& ms, float r, float g, float b, float a = 1.0f) {
+        float* out = grow();
+        memcpy(out, ms.top().m, 16 * sizeof(float));
+        normalMatrix(ms.top().m, out + 16);
+        out[25] = r; out[26] = g; out[27] = b; out[28] = a;
+    }
+
+    // Box of the given size, like drawBox.
+    void addBox(MatrixStack& ms, float sx, float sy, float sz, float r, float g, float b) {
+        MatrixScope scope(ms);
+        ms.scale(sx, sy, sz);
+        add(ms, r, g, b);
+    }
+
+    // Sphere of the given radius, like solidSphere.
+    void addSphere(MatrixStack& ms, float radius, float r, float g, float b, float a = 1.0f) {
+        MatrixScope scope(ms);
+        ms.scale(radius, radius, radius);
+        add(ms, r, g, b, a);
+    }
+
+    // Flattened sphere like drawShadow, for the shadows batch.
+    void addShadow(MatrixStack& ms, float radius) {
+        MatrixScope scope(ms);
+        ms.scale(1.0f, 0.01f, 1.0f);
+        addSphere(ms, radius, 0.0f, 0.0f, 0.0f, 0.4f);
+    }
+
+    size_t size() const { return instances.size() / INSTANCE_FLOATS; }
+
+    // Draws every instance added since the last flush and empties the batch.
+    void flush(InstanceRenderer& renderer, const MeshCache& meshes) {
+        if (instances.empty()) return;
+        renderer.draw(meshes, meshes.get(shape, slices, stacks), instances);
+        instances.clear();
+    }
+
+private:
+    MeshShape shape;
+    int slices, stacks;
+    std::vector<float> instances;
+
+    float* grow() {
+        instances.resize(instances.size() + INSTANCE_FLOATS);
+        return &instances[instances.size() - INSTANCE_FLOATS];
+    }
+};
+
+// Batches for the repeated parts of the scene; the caller of renderScene
+// owns one set and it is passed down with the matrix stack.
+struct SceneInstances {
+    InstanceBatch windows{ MESH_CUBE };
+    InstanceBatch bodies{ MESH_CUBE };             // passenger bodies and legs
+    InstanceBatch heads{ MESH_SPHERE, 8, 6 };
+    InstanceBatch shadows{ MESH_SPHERE, 16, 8 };   // under the passengers, unlit
+};
+
+// ---------- Static World ----------
+// Everything that never moves (ground and hills, rails and sleepers, the
+// platform, the sign post and the trees) is transformed into world space
+// once, when the scene is built, and merged into one vertex buffer in the
+// STREAM_FLOATS layout, one contiguous range per material. A frame then
+// draws it under the bare view matrix with one glDrawArrays per material,
+// without touching the matrix stack.
+class StaticWorld {
+public:
+    // Drops the previous bake; needs its context to be current.
+    void clear() {
+        if (vbo) glDeleteBuffers(1, &vbo);
+        vbo = 0;
+        groups.clear();
+        vertices.clear();
+        current = -1;
+    }
+
+    // Following adds go to the range for this material, drawn with
+    // lighting on or off.
+    void setMaterial(const Material& material, bool lit = true) {
+        for (size_t i = 0; i < groups.size(); ++i) {
+            if (groups[i].lit == lit && memcmp(&groups[i].material, &material, sizeof(Material)) == 0) {
+                current = (int)i;
+                return;
+            }
+        }
+        groups.push_back({ material, lit, 0, 0, {} });
+        current = (int)groups.size() - 1;
+    }
+
+    // The cached mesh under the stack's current matrix.
+    void add(const MatrixStack& ms, const Mesh& mesh, float r, float g, float b, float a = 1.0f) {
+        assert(current >= 0 && "StaticWorld::setMaterial first");
+        std::vector<float>& out = groups[current].vertices;
+        float normal[9], color[4] = { r, g, b, a };
+        normalMatrix(ms.top().m, normal);
+        size_t end = out.size();
+        out.resize(end + (size_t)mesh.count * STREAM_FLOATS);
+        transformMesh(mesh, ms.top().m, normal, color, &out[end]);
+    }
+
+    void addBox(MatrixStack& ms, const MeshCache& meshes, float sx, float sy, float sz, float r, float g, float b) {
+        MatrixScope scope(ms);
+        ms.scale(sx, sy, sz);
+        add(ms, meshes.get(MESH_CUBE), r, g, b);
+    }
+
+    void addSphere(MatrixStack& ms, const MeshCache& meshes, float radius, int slices, int stacks,
+                   float r, float g, float b, float a = 1.0f) {
+        MatrixScope scope(ms);
+        ms.scale(radius, radius, radius);
+        add(ms, meshes.get(MESH_SPHERE, slices, stacks), r, g, b, a);
+    }
+
+    // A horizontal quad facing up, x0..x1 by z0..z1 at height y. Split
+    // along the same diagonal as GL_QUADS: fog is interpolated per vertex,
+    // and over quads as large as the ground the split shows.
+    void addQuad(float x0, float z0, float x1, float z1, float y, float r, float g, float b) {
+        assert(current >= 0 && "StaticWorld::setMaterial first");
+        const float corners[6][2] = { { x0, z0 }, { x1, z0 }, { x0, z1 }, { x1, z0 }, { x1, z1 }, { x0, z1 } };
+        for (auto& c : corners) {
+            float v[STREAM_FLOATS] = { c[0], y, c[1], 0.0f, 1.0f, 0.0f, r, g, b, 1.0f };
+            groups[current].vertices.insert(groups[current].vertices.end(), v, v + STREAM_FLOATS);
+        }
+    }
+
+    // Concatenates the ranges and uploads them, in a buffer object if the
+    // mesh cache uses them.
+    void finish(const MeshCache& meshes) {
+        for (Group& group : groups) {
+            group.first = (GLint)(vertices.size() / STREAM_FLOATS);
+            group.count = (GLsizei)(group.vertices.size() / STREAM_FLOATS);
+            vertices.insert(vertices.end(), group.vertices.begin(), group.vertices.end());
+            std::vector<float>().swap(group.vertices);
+        }
+        if (meshes.buffersEnabled()) {
+            glGenBuffers(1, &vbo);
+            glBindBuffer(GL_ARRAY_BUFFER, vbo);
+            glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), vertices.data(), GL_STATIC_DRAW);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+        }
+    }
+
+    // Draws with ms's current matrix as the view; leaves lighting on.
+    void draw(const MatrixStack& ms) const {
+        PERF_SCOPE(perfGeometry, groups.size());
+        ms.upload();
+        if (vbo) glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        enableStreamArrays(vbo ? nullptr : vertices.data());
+        for (const Group& group : groups) {
+            ::setMaterial(group.material);
+            if (group.lit) glEnable(GL_LIGHTING);
+            else glDisable(GL_LIGHTING);
+            glDrawCalls++;
+            glDrawArrays(GL_TRIANGLES, group.first, group.count);
+        }
+        disableStreamArrays();
+        if (vbo) glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glEnable(GL_LIGHTING);
+    }
+
+    size_t vertexCount() const { return vertices.size() / STREAM_FLOATS; }
+
+private:
+    struct Group {
+        Material material;
+        bool lit;
+        GLint first;
+        GLsizei count;
+        std::vector<float> vertices;   // while baking
+    };
+    std::vector<Group> groups;
+    std::vector<float> vertices;   // all ranges, kept for client-side arrays
+    GLuint vbo = 0;
+    int current = -1;
+};
+
+StaticWorld staticWorld;
+
 // ---------- Scene setup (Lighting, Fog) ----------
 void initLighting() {
     glEnable(GL_LIGHTING);
@@ -191,157 +938,102 @@ void initFog() {
 }
 
 // ---------- Drawing Functions ----------
-void drawGround() {
-    custom_push_matrix();
-    glLoadMatrixf(modelViewMatrix.m);
-    float amb[] = { 0.08f, 0.25f, 0.08f, 1.0f };
-    float dif[] = { 0.12f, 0.45f, 0.12f, 1.0f };
-    float spec[] = { 0.02f, 0.02f, 0.02f, 1.0f };
-    setMaterial(amb, dif, spec, 5.0f);
-    glColor3f(0.12f, 0.45f, 0.12f);
-    glBegin(GL_QUADS);
-    glVertex3f(-300.0f, 0.0f, -200.0f);
-    glVertex3f(300.0f, 0.0f, -200.0f);
-    glVertex3f(300.0f, 0.0f, 200.0f);
-    glVertex3f(-300.0f, 0.0f, 200.0f);
-    glEnd();
-    custom_pop_matrix();
-
+// The ground, tracks, platform, sign post and trees, in world space.
+void bakeStaticWorld(const MeshCache& meshes) {
+    TRACE_FUNCTION();
+    staticWorld.clear();
+    MatrixStack ms;
+    ms.loadIdentity();
+
+    staticWorld.setMaterial(GROUND_MATERIAL);
+    staticWorld.addQuad(-300.0f, -200.0f, 300.0f, 200.0f, 0.0f, 0.12f, 0.45f, 0.12f);
     for (int i = -1; i <= 1; ++i) {
-        custom_push_matrix();
-        custom_translate(i * 80.0f, 0.0f, -150.0f);
-        custom_scale(90.0f, 1.0f, 40.0f);
-        glLoadMatrixf(modelViewMatrix.m);
-        glColor3f(0.14f, 0.35f, 0.14f);
-        glutSolidSphere(1.5f, 24, 12);
-        custom_pop_matrix();
-    }
-}
-
-void drawPlatform() {
-    custom_push_matrix();
-    glLoadMatrixf(modelViewMatrix.m);
-    float amb[] = { 0.18f, 0.18f, 0.18f, 1.0f };
-    float dif[] = { 0.6f, 0.6f, 0.6f, 1.0f };
-    float spec[] = { 0.1f, 0.1f, 0.1f, 1.0f };
-    setMaterial(amb, dif, spec, 10.0f);
-    glColor3f(0.65f, 0.65f, 0.65f);
-    glBegin(GL_QUADS);
-    glVertex3f(-200.0f, 0.01f, 6.0f);
-    glVertex3f(200.0f, 0.01f, 6.0f);
-    glVertex3f(200.0f, 0.01f, 20.0f);
-    glVertex3f(-200.0f, 0.01f, 20.0f);
-    glEnd();
-    glColor3f(1.0f, 0.93f, 0.0f);
-    glBegin(GL_QUADS);
-    glVertex3f(-200.0f, 0.02f, 5.6f);
-    glVertex3f(200.0f, 0.02f, 5.6f);
-    glVertex3f(200.0f, 0.02f, 6.0f);
-    glVertex3f(-200.0f, 0.02f, 6.0f);
-    glEnd();
-    custom_pop_matrix();
-}
-
-void drawTracks() {
-    custom_push_matrix();
-    float amb[] = { 0.1f, 0.1f, 0.1f, 1.0f };
-    float dif[] = { 0.3f, 0.3f, 0.3f, 1.0f };
-    float spec[] = { 0.8f, 0.8f, 0.8f, 1.0f };
-    setMaterial(amb, dif, spec, 100.0f);
-    glColor3f(0.3f, 0.3f, 0.3f);
-    custom_push_matrix();
-    custom_translate(0.0f, 0.2f, -1.0f);
-    drawBox(600.0f, 0.2f, 0.2f);
-    custom_pop_matrix();
-    custom_push_matrix();
-    custom_translate(0.0f, 0.2f, 1.0f);
-    drawBox(600.0f, 0.2f, 0.2f);
-    custom_pop_matrix();
-    float amb_s[] = { 0.1f, 0.05f, 0.02f, 1.0f };
-    float dif_s[] = { 0.36f, 0.22f, 0.12f, 1.0f };
-    float spec_s[] = { 0.05f, 0.05f, 0.05f, 1.0f };
-    setMaterial(amb_s, dif_s, spec_s, 10.0f);
-    glColor3f(0.36f, 0.22f, 0.12f);
+        MatrixScope scope(ms);
+        ms.translate(i * 80.0f, 0.0f, -150.0f);
+        ms.scale(90.0f, 1.0f, 40.0f);
+        staticWorld.addSphere(ms, meshes, 1.5f, 24, 12, 0.14f, 0.35f, 0.14f);
+    }
+
+    staticWorld.setMaterial(RAIL_MATERIAL);
+    for (float z : { -1.0f, 1.0f }) {
+        MatrixScope scope(ms);
+        ms.translate(0.0f, 0.2f, z);
+        staticWorld.addBox(ms, meshes, 600.0f, 0.2f, 0.2f, 0.3f, 0.3f, 0.3f);
+    }
+    staticWorld.setMaterial(SLEEPER_MATERIAL);
     for (float x = -300.0f; x <= 300.0f; x += 4.0f) {
-        custom_push_matrix();
-        custom_translate(x, 0.1f, 0.0f);
-        drawBox(1.0f, 0.15f, 5.0f);
-        custom_pop_matrix();
+        MatrixScope scope(ms);
+        ms.translate(x, 0.1f, 0.0f);
+        staticWorld.addBox(ms, meshes, 1.0f, 0.15f, 5.0f, 0.36f, 0.22f, 0.12f);
     }
-    custom_pop_matrix();
-}
 
-void drawTree(float x, float z) {
-    glDisable(GL_LIGHTING);
-    custom_push_matrix();
-    custom_translate(x, 0.02f, z);
-    drawShadow(1.2f);
-    custom_pop_matrix();
-    glEnable(GL_LIGHTING);
+    staticWorld.setMaterial(PLATFORM_MATERIAL);
+    staticWorld.addQuad(-200.0f, 6.0f, 200.0f, 20.0f, 0.01f, 0.65f, 0.65f, 0.65f);
+    staticWorld.addQuad(-200.0f, 5.6f, 200.0f, 6.0f, 0.02f, 1.0f, 0.93f, 0.0f);
+    {
+        MatrixScope post(ms);
+        ms.translate(30.0f, 3.5f, 15.0f); // under the rotating sign
+        staticWorld.addBox(ms, meshes, 0.4f, 7.0f, 0.4f, 0.3f, 0.3f, 0.3f);
+    }
+    for (auto& t : trees) {
+        MatrixScope scope(ms);
+        ms.translate(t.x, 0.0f, t.z);
+        staticWorld.addBox(ms, meshes, 0.4f, 1.5f, 0.4f, 0.35f, 0.18f, 0.07f);
+        ms.translate(0.0f, 1.9f, 0.0f);
+        staticWorld.addSphere(ms, meshes, 1.1f, 18, 10, 0.06f, 0.45f, 0.08f);
+        ms.translate(0.4f, -0.3f, 0.3f);
+        staticWorld.addSphere(ms, meshes, 0.8f, 18, 10, 0.06f, 0.45f, 0.08f);
+    }
 
-    custom_push_matrix();
-    custom_translate(x, 0.0f, z);
-    glColor3f(0.35f, 0.18f, 0.07f);
-    drawBox(0.4f, 1.5f, 0.4f);
-    custom_translate(0.0f, 1.9f, 0.0f);
-    glLoadMatrixf(modelViewMatrix.m);
-    glColor3f(0.06f, 0.45f, 0.08f);
-    glutSolidSphere(1.1f, 18, 10);
-    custom_translate(0.4f, -0.3f, 0.3f);
-    glLoadMatrixf(modelViewMatrix.m);
-    glutSolidSphere(0.8f, 18, 10);
-    custom_pop_matrix();
-}
-
-void drawPassenger(const Passenger& p) {
-    glDisable(GL_LIGHTING);
-    custom_push_matrix();
-    custom_translate(p.x, 0.03f, p.z);
-    drawShadow(0.3f);
-    custom_pop_matrix();
-    glEnable(GL_LIGHTING);
+    staticWorld.setMaterial(PLATFORM_MATERIAL, false);
+    for (auto& t : trees) {
+        MatrixScope scope(ms);
+        ms.translate(t.x, 0.02f, t.z);
+        ms.scale(1.0f, 0.01f, 1.0f);
+        staticWorld.addSphere(ms, meshes, 1.2f, 16, 8, 0.0f, 0.0f, 0.0f, 0.4f);
+    }
+    staticWorld.finish(meshes);
+}
+
+// Passengers only add instances; renderScene draws the batches once all of
+// them are in.
+void addPassenger(MatrixStack& ms, SceneInstances& instances, const Passenger& p) {
+    {
+        MatrixScope scope(ms);
+        ms.translate(p.x, 0.03f, p.z);
+        instances.shadows.addShadow(ms, 0.3f);
+    }
 
-    custom_push_matrix();
-    custom_translate(p.x, 0.8f, p.z);
+    MatrixScope scope(ms);
+    ms.translate(p.x, 0.8f, p.z);
     float bob = (p.standing) ? 0.0f : sinf(p.phase) * 0.08f;
-    custom_translate(0.0f, bob, 0.0f);
-    custom_scale(0.8f, 0.8f, 0.8f);
-    glLoadMatrixf(modelViewMatrix.m);
-    glColor3f(0.1f, 0.1f, 0.1f);
-    custom_push_matrix();
-    custom_translate(0.0f, 0.3f, 0.0f);
-    glLoadMatrixf(modelViewMatrix.m);
-    glutSolidSphere(0.22f, 8, 6);
-    custom_pop_matrix();
-    drawBox(0.36f, 0.6f, 0.18f);
-    custom_push_matrix();
-    custom_translate(0.0f, -0.6f, 0.0f);
-    drawBox(0.12f, 0.6f, 0.12f);
-    custom_translate(0.16f, 0.0f, 0.0f);
-    drawBox(0.12f, 0.6f, 0.12f);
-    custom_pop_matrix();
-    custom_pop_matrix();
-}
-
-
-void drawRotatingSign() {
-    custom_push_matrix();
-    custom_translate(30.0f, 0.0f, 15.0f); // Position on the platform
-
-    // Tall stand/post
-    custom_push_matrix();
-    custom_translate(0.0f, 3.5f, 0.0f); // Center the post
-    glColor3f(0.3f, 0.3f, 0.3f);
-    drawBox(0.4f, 7.0f, 0.4f);
-    custom_pop_matrix();
+    ms.translate(0.0f, bob, 0.0f);
+    ms.scale(0.8f, 0.8f, 0.8f);
+    {
+        MatrixScope head(ms);
+        ms.translate(0.0f, 0.3f, 0.0f);
+        instances.heads.addSphere(ms, 0.22f, 0.1f, 0.1f, 0.1f);
+    }
+    instances.bodies.addBox(ms, 0.36f, 0.6f, 0.18f, 0.1f, 0.1f, 0.1f);
+    MatrixScope legs(ms);
+    ms.translate(0.0f, -0.6f, 0.0f);
+    instances.bodies.addBox(ms, 0.12f, 0.6f, 0.12f, 0.1f, 0.1f, 0.1f);
+    ms.translate(0.16f, 0.0f, 0.0f);
+    instances.bodies.addBox(ms, 0.12f, 0.6f, 0.12f, 0.1f, 0.1f, 0.1f);
+}
+
+
+// The board only; its post is part of the static world.
+void drawRotatingSign(MatrixStack& ms, const MeshCache& meshes) {
+    TRACE_FUNCTION();
+    MatrixScope scope(ms);
+    ms.translate(30.0f, 0.0f, 15.0f); // Position on the platform
 
     // Rotating sign part
-    custom_translate(0.0f, 7.5f, 0.0f); // Position sign on top of the post
-    custom_rotate(signRotation, 0.0f, 1.0f, 0.0f); // Apply rotation
+    ms.translate(0.0f, 7.5f, 0.0f); // Position sign on top of the post
+    ms.rotate(signRotation, 0.0f, 1.0f, 0.0f); // Apply rotation
     glColor3f(0.8f, 0.8f, 0.6f);
-    drawBox(3.0f, 1.5f, 0.2f); // The sign board
-
-    custom_pop_matrix();
+    drawBox(ms, meshes, 3.0f, 1.5f, 0.2f); // The sign board
 }
 
 
@@ -354,6 +1046,8 @@ void spawnSmoke(float x, float y, float z) {
 }
 
 void updateSmoke() {
+    TRACE_FUNCTION();
+    PERF_SCOPE(perfParticles, smokeParticles.size());
     for (size_t i = 0; i < smokeParticles.size(); ) {
         smokeParticles[i].y += 0.12f;
         smokeParticles[i].x += 0.04f + static_cast<float>(rand() % 20) / 200.0f;
@@ -365,86 +1059,84 @@ void updateSmoke() {
     }
 }
 
-void drawSmoke() {
+void drawSmoke(MatrixStack& ms, const MeshCache& meshes) {
+    TRACE_FUNCTION();
     glEnable(GL_BLEND);
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
     glDisable(GL_LIGHTING);
     for (auto& s : smokeParticles) {
         float alpha = (s.life / s.initialLife) * 0.6f;
         glColor4f(0.6f, 0.6f, 0.6f, alpha);
-        custom_push_matrix();
-        custom_translate(s.x, s.y, s.z);
-        glLoadMatrixf(modelViewMatrix.m);
-        glutSolidSphere(s.r * 0.8f, 12, 8);
-        custom_pop_matrix();
+        MatrixScope scope(ms);
+        ms.translate(s.x, s.y, s.z);
+        solidSphere(ms, meshes, s.r * 0.8f, 12, 8);
     }
     glEnable(GL_LIGHTING);
     glDisable(GL_BLEND);
 }
 
-void drawEngine(float baseX, float zOffset) {
-    custom_push_matrix();
-    custom_translate(baseX, 1.2f, zOffset);
+void drawEngine(MatrixStack& ms, const MeshCache& meshes, float baseX, float zOffset) {
+    MatrixScope scope(ms);
+    ms.translate(baseX, 1.2f, zOffset);
     glColor3f(0.78f, 0.14f, 0.14f);
-    drawBox(10.0f, 1.6f, 3.2f);
+    drawBox(ms, meshes, 10.0f, 1.6f, 3.2f);
     glColor3f(0.6f, 0.05f, 0.05f);
-    custom_translate(2.8f, 0.8f, 0.0f);
-    drawBox(3.4f, 2.0f, 3.0f);
-    custom_translate(-6.8f, -0.1f, 0.0f);
+    ms.translate(2.8f, 0.8f, 0.0f);
+    drawBox(ms, meshes, 3.4f, 2.0f, 3.0f);
+    ms.translate(-6.8f, -0.1f, 0.0f);
     glColor3f(0.72f, 0.2f, 0.18f);
-    drawBox(4.5f, 1.2f, 3.0f);
-    custom_translate(1.5f, 1.3f, 0.0f);
-    glLoadMatrixf(modelViewMatrix.m);
+    drawBox(ms, meshes, 4.5f, 1.2f, 3.0f);
+    ms.translate(1.5f, 1.3f, 0.0f);
     glColor3f(0.2f, 0.2f, 0.2f);
-    drawCylinder(0.45f, 1.2f, 12);
-    custom_pop_matrix();
+    drawCylinder(ms, meshes, 0.45f, 1.2f, 12);
 }
 
-void drawCoach(float baseX, float zOffset, const float colorC[3]) {
-    custom_push_matrix();
-    custom_translate(baseX, 1.2f, zOffset);
+// The windows go into the batch, drawn once per pass over the train.
+void drawCoach(MatrixStack& ms, const MeshCache& meshes, InstanceBatch& windows, float baseX, float zOffset, const float colorC[3]) {
+    MatrixScope scope(ms);
+    ms.translate(baseX, 1.2f, zOffset);
     glColor3f(colorC[0], colorC[1], colorC[2]);
-    drawBox(14.0f, 2.0f, 3.0f);
-    glColor3f(0.88f, 0.95f, 1.0f);
+    drawBox(ms, meshes, 14.0f, 2.0f, 3.0f);
     for (float x = -14.0f / 2.0f + 1.5f; x < 14.0f / 2.0f - 1.0f; x += 3.0f) {
-        custom_push_matrix();
-        custom_translate(x, 0.2f, 1.55f);
-        drawBox(1.8f, 0.9f, 0.06f);
-        custom_translate(0.0f, 0.0f, -3.1f);
-        drawBox(1.8f, 0.9f, 0.06f);
-        custom_pop_matrix();
+        MatrixScope window(ms);
+        ms.translate(x, 0.2f, 1.55f);
+        windows.addBox(ms, 1.8f, 0.9f, 0.06f, 0.88f, 0.95f, 1.0f);
+        ms.translate(0.0f, 0.0f, -3.1f);
+        windows.addBox(ms, 1.8f, 0.9f, 0.06f, 0.88f, 0.95f, 1.0f);
     }
-    custom_pop_matrix();
 }
 
-void drawTrainAndReflection() {
+void drawTrainAndReflection(MatrixStack& ms, const MeshCache& meshes, InstanceRenderer& renderer,
+                            SceneInstances& instances) {
+    TRACE_FUNCTION();
     // Draw the actual train
-    drawEngine(trainPos, 0.0f);
+    drawEngine(ms, meshes, trainPos, 0.0f);
     const float c1[] = { 0.12f, 0.4f, 0.8f };
     const float c2[] = { 0.9f, 0.45f, 0.12f };
     const float c3[] = { 0.12f, 0.7f, 0.45f };
-    drawCoach(trainPos + 16.0f, 0.0f, c1);
-    drawCoach(trainPos + 34.0f, 0.0f, c2);
-    drawCoach(trainPos + 52.0f, 0.0f, c3);
-    drawCoach(trainPos + 70.0f, 0.0f, c1);
+    drawCoach(ms, meshes, instances.windows, trainPos + 16.0f, 0.0f, c1);
+    drawCoach(ms, meshes, instances.windows, trainPos + 34.0f, 0.0f, c2);
+    drawCoach(ms, meshes, instances.windows, trainPos + 52.0f, 0.0f, c3);
+    drawCoach(ms, meshes, instances.windows, trainPos + 70.0f, 0.0f, c1);
+    instances.windows.flush(renderer, meshes);
 
    
     glEnable(GL_BLEND);
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    custom_push_matrix();
-    custom_scale(1.0f, -1.0f, 1.0f); // Reflect across the ground plane
-    custom_translate(0.0f, 0.2f, 0.0f); // Adjust position slightly to avoid z-fighting
+    MatrixScope reflection(ms);
+    ms.scale(1.0f, -1.0f, 1.0f); // Reflect across the ground plane
+    ms.translate(0.0f, 0.2f, 0.0f); // Adjust position slightly to avoid z-fighting
     float amb_ref[] = { 0.1f, 0.1f, 0.1f, 0.4f }; // Semi-transparent material
     float dif_ref[] = { 0.2f, 0.2f, 0.2f, 0.4f };
     setMaterial(amb_ref, dif_ref, amb_ref, 10.0f);
 
-    drawEngine(trainPos, 0.0f);
-    drawCoach(trainPos + 16.0f, 0.0f, c1);
-    drawCoach(trainPos + 34.0f, 0.0f, c2);
-    drawCoach(trainPos + 52.0f, 0.0f, c3);
-    drawCoach(trainPos + 70.0f, 0.0f, c1);
+    drawEngine(ms, meshes, trainPos, 0.0f);
+    drawCoach(ms, meshes, instances.windows, trainPos + 16.0f, 0.0f, c1);
+    drawCoach(ms, meshes, instances.windows, trainPos + 34.0f, 0.0f, c2);
+    drawCoach(ms, meshes, instances.windows, trainPos + 52.0f, 0.0f, c3);
+    drawCoach(ms, meshes, instances.windows, trainPos + 70.0f, 0.0f, c1);
+    instances.windows.flush(renderer, meshes);
 
-    custom_pop_matrix();
     glDisable(GL_BLEND);
 }
 
@@ -468,6 +1160,7 @@ void buildScene() {
 }
 
 void updateScene() {
+    TRACE_FUNCTION();
     trainPos -= trainSpeed;
     if (trainPos < -300.0f) trainPos = 300.0f;
     signRotation += 1.0f; 
@@ -482,39 +1175,88 @@ void updateScene() {
 }
 
 // ---------- Main Render Loop ----------
-void renderScene() {
+// One frame with the given mesh cache, instance renderer and batches; the
+// matrix stack is local. The no-argument version below is the render
+// thread's, with the program's own set.
+void renderScene(const MeshCache& meshes, InstanceRenderer& renderer, SceneInstances& instances) {
+    TRACE_FUNCTION();
+    PERF_SCOPE(perfFrameOther, 1);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
     // Set up camera using our custom lookAt function
     cameraHeight = baseCameraHeight + sinf(cameraAngle * 0.5f) * 1.5f;
     float camX = cameraRadius * cosf(cameraAngle * M_PI / 180.0f);
     float camZ = cameraRadius * sinf(cameraAngle * M_PI / 180.0f);
-    modelViewMatrix = custom_look_at(Vec3(camX, cameraHeight, camZ), Vec3(0.0f, 2.5f, 0.0f), Vec3(0.0f, 1.0f, 0.0f));
-
-    drawGround();
-    drawTracks();
-    drawPlatform();
-    drawRotatingSign(); // NEW
+    MatrixStack ms;
+    ms.load(custom_look_at(Vec3(camX, cameraHeight, camZ), Vec3(0.0f, 2.5f, 0.0f), Vec3(0.0f, 1.0f, 0.0f)));
 
-    for (auto& t : trees) drawTree(t.x, t.z);
-    for (auto& p : passengers) drawPassenger(p);
+    {
+        TRACE_SCOPE("drawStaticWorld");
+        staticWorld.draw(ms);
+    }
+    setMaterial(PLATFORM_MATERIAL);
+    drawRotatingSign(ms, meshes); // NEW
+
+    {
+        TRACE_SCOPE("drawPassengers");
+        for (auto& p : passengers) addPassenger(ms, instances, p);
+        glDisable(GL_LIGHTING);
+        instances.shadows.flush(renderer, meshes);
+        glEnable(GL_LIGHTING);
+        instances.bodies.flush(renderer, meshes);
+        instances.heads.flush(renderer, meshes);
+    }
 
     glDisable(GL_LIGHTING);
     glEnable(GL_BLEND); // Enable transparency
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
-    custom_push_matrix();
-    custom_translate(trainPos + 35.0f, 0.02f, 0.0f);
-    custom_scale(80.0f, 1.0f, 3.5f); // Stretch the shadow to match the train's length
-    drawShadow(1.0f);                // Draw a small shadow that will be stretched
-    custom_pop_matrix();
+    {
+        MatrixScope scope(ms);
+        ms.translate(trainPos + 35.0f, 0.02f, 0.0f);
+        ms.scale(80.0f, 1.0f, 3.5f); // Stretch the shadow to match the train's length
+        drawShadow(ms, meshes, 1.0f); // Draw a small shadow that will be stretched
+    }
 
     glDisable(GL_BLEND); // Disable transparency
     glEnable(GL_LIGHTING);
 
-    drawTrainAndReflection(); // Draws both train and its reflection
-    drawSmoke();
+    drawTrainAndReflection(ms, meshes, renderer, instances); // Draws both train and its reflection
+    drawSmoke(ms, meshes);
+    assert(ms.size() == 1 && "unbalanced push/pop in renderScene");
+}
+
+InstanceRenderer instanceRenderer;
+SceneInstances sceneInstances;   // reused each frame so the batches keep their capacity
+
+void renderScene() { renderScene(meshCache, instanceRenderer, sceneInstances); }
+
+// ---------- Shared-Memory Sink ----------
+// With --shm=NAME every rendered frame is also read back into a slot of
+// /dev/shm/NAME for other local processes (see shm_frame_sink.h and
+// shm_frame_reader.cpp).
+const char* shmName = nullptr;
+int shmSlots = 3;
+ShmFrameSink shmSink;
+
+void publishFrame() {
+    TRACE_FUNCTION();
+    if (!shmName) return;
+    if (shmSink.width() != windowWidth || shmSink.height() != windowHeight) {
+        if (!shmSink.open(shmName, windowWidth, windowHeight, shmSlots)) {
+            fprintf(stderr, "Could not create /dev/shm/%s\n", shmName);
+            shmName = nullptr;
+            return;
+        }
+    }
+    glReadPixels(0, 0, windowWidth, windowHeight, GL_RGBA, GL_UNSIGNED_BYTE, shmSink.beginFrame());
+    shmSink.endFrame();
+}
 
+void display() {
+    TRACE_FUNCTION();
+    renderScene();
+    publishFrame();
     glutSwapBuffers();
 }
 
@@ -533,37 +1275,221 @@ void keyboard(unsigned char key, int x, int y) {
     if (key == 27 || key == 'q') exit(0);
 }
 
-void timerFunc(int v) {
+// One animation tick (16 ms of scene time); driven by the GLUT timer or by
+// the headless renderer.
+void stepScene() {
+    TRACE_FUNCTION();
     cameraAngle += 0.04f;
     if (cameraAngle >= 360.0f) cameraAngle -= 360.0f;
     updateScene();
+}
+
+const int TICK_MS = 16;
+
+void timerFunc(int v) {
+    stepScene();
     glutPostRedisplay();
-    glutTimerFunc(16, timerFunc, 0); // ~60 FPS
+    glutTimerFunc(TICK_MS, timerFunc, 0); // ~60 FPS
 }
 
 // ---------- Init and Main ----------
-void initScene() {
+void initScene(unsigned int seed) {
     glEnable(GL_DEPTH_TEST);
     glShadeModel(GL_SMOOTH);
     glEnable(GL_NORMALIZE);
     initLighting();
     initFog();
-    srand(static_cast<unsigned int>(time(nullptr)));
+    glClearColor(0.75f, 0.85f, 0.95f, 1.0f);
+    srand(seed);
     buildScene();
+    buildMeshes(meshCache);
+    bakeStaticWorld(meshCache);
+}
+
+// ---------- Headless Rendering ----------
+// Renders frames back to back on the simulated clock (one stepScene per
+// frame) into an offscreen EGL pbuffer, with no window or display server.
+// Frames are handed to the frame writer (see frame_writer.h for the
+// formats), whose thread converts and writes them while the next frame is
+// drawn.
+#ifdef STATION_HEADLESS_EGL
+bool createHeadlessContext(int w, int h) {
+    EGLDisplay candidates[2] = { EGL_NO_DISPLAY, EGL_NO_DISPLAY };
+#ifdef EGL_PLATFORM_SURFACELESS_MESA
+    auto getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay) candidates[0] = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+#endif
+    candidates[1] = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    for (EGLDisplay dpy : candidates) {
+        EGLint major, minor;
+        if (dpy == EGL_NO_DISPLAY || !eglInitialize(dpy, &major, &minor)) continue;
+        const EGLint configAttribs[] = {
+            EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+            EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_DEPTH_SIZE, 24, EGL_NONE
+        };
+        const EGLint surfaceAttribs[] = { EGL_WIDTH, w, EGL_HEIGHT, h, EGL_NONE };
+        EGLConfig config;
+        EGLint count = 0;
+        if (!eglChooseConfig(dpy, configAttribs, &config, 1, &count) || count == 0) continue;
+        EGLSurface surface = eglCreatePbufferSurface(dpy, config, surfaceAttribs);
+        if (surface == EGL_NO_SURFACE || !eglBindAPI(EGL_OPENGL_API)) continue;
+        EGLContext ctx = eglCreateContext(dpy, config, EGL_NO_CONTEXT, nullptr);
+        if (ctx != EGL_NO_CONTEXT && eglMakeCurrent(dpy, surface, surface, ctx)) return true;
+    }
+    return false;
 }
+#endif
 
+// Reads frames back through two pixel-pack buffers: glReadPixels of frame N
+// only queues the copy into one buffer, and the other buffer, holding frame
+// N - 1 and finished by now, is mapped and copied into a writer slot. The
+// GL pipeline never drains waiting for the readback.
+class FrameReadback {
+public:
+    FrameReadback(int w_, int h_) : w(w_), h(h_) {
+        glGenBuffers(2, pbo);
+        for (GLuint buffer : pbo) {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer);
+            glBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr)w * h * 4, nullptr, GL_STREAM_READ);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+    ~FrameReadback() { glDeleteBuffers(2, pbo); }
+
+    // Starts reading the current frame and passes the previous one on.
+    void capture(FrameWriter& writer) {
+        TRACE_SCOPE("readback");
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[count % 2]);
+        glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        if (count > 0) submit(writer, pbo[(count - 1) % 2]);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        count++;
+    }
+
+    // Passes on the last frame started by capture().
+    void flush(FrameWriter& writer) {
+        if (count > 0) submit(writer, pbo[(count - 1) % 2]);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        count = 0;
+    }
+
+private:
+    int w, h;
+    GLuint pbo[2];
+    long count = 0;
+
+    void submit(FrameWriter& writer, GLuint buffer) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer);
+        const void* pixels = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+        uint32_t* slot = writer.acquireSlot();
+        if (pixels) memcpy(slot, pixels, (size_t)w * h * 4);
+        else memset(slot, 0, (size_t)w * h * 4);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        writer.submitSlot();
+    }
+};
+
+int renderHeadless(int frames, unsigned int seed, const char* out, FrameFormat format, int slots) {
+#ifdef STATION_HEADLESS_EGL
+    if (!createHeadlessContext(windowWidth, windowHeight)) {
+        fprintf(stderr, "Could not create a headless EGL OpenGL context\n");
+        return 1;
+    }
+    initScene(seed);
+    reshape(windowWidth, windowHeight);
+    FrameWriter writer;
+    if (!writer.open(format, out, windowWidth, windowHeight, 1000, TICK_MS, slots)) {
+        fprintf(stderr, "Could not open %s\n", out);
+        return 1;
+    }
+    FrameReadback readback(windowWidth, windowHeight);
+    for (int i = 0; i < frames && writer.ok(); ++i) {
+        renderScene();
+        publishFrame();
+        readback.capture(writer);
+        stepScene();
+    }
+    readback.flush(writer);
+    bool ok = writer.close();
+    writer.printCounters(stderr);
+    if (!ok) {
+        fprintf(stderr, "Failed to write frames to %s\n", out);
+        return 1;
+    }
+    return 0;
+#else
+    (void)frames; (void)seed; (void)out; (void)format; (void)slots;
+    fprintf(stderr, "Headless rendering needs EGL, which this build does not have\n");
+    return 1;
+#endif
+}
+
+// With --trace=FILE the scene functions and the frame writer record trace
+// events (see trace_events.h), written to FILE when the program exits.
+const char* traceFile = nullptr;
+
+void finishTrace() {
+    if (!writeTraceJson(traceFile)) fprintf(stderr, "Failed to write trace %s\n", traceFile);
+}
+
+void finishPerf() { printPerfReport(stderr); }
+
+// Accepts "--name value" and "--name=value"; returns nullptr if argv[i] is
+// not that option.
+const char* optionValue(int argc, char** argv, int& i, const char* name) {
+    size_t len = strlen(name);
+    if (strncmp(argv[i], name, len) != 0) return nullptr;
+    if (argv[i][len] == '=') return argv[i] + len + 1;
+    if (argv[i][len] == '\0' && i + 1 < argc) return argv[++i];
+    return nullptr;
+}
+
+// Tools that reuse the station (the benchmark) define STATION_NO_MAIN and
+// include this file.
+#ifndef STATION_NO_MAIN
 int main(int argc, char** argv) {
+    int frames = -1;
+    unsigned int seed = static_cast<unsigned int>(time(nullptr));
+    const char* out = "-";
+    bool y4m = false;
+    int writerSlots = 4;
+    for (int i = 1; i < argc; ++i) {
+        const char* v;
+        if ((v = optionValue(argc, argv, i, "--frames"))) frames = atoi(v);
+        else if ((v = optionValue(argc, argv, i, "--seed"))) seed = static_cast<unsigned int>(strtoul(v, nullptr, 10));
+        else if ((v = optionValue(argc, argv, i, "--out"))) out = v;
+        else if (strcmp(argv[i], "--y4m") == 0) y4m = true;
+        else if ((v = optionValue(argc, argv, i, "--writer-slots"))) writerSlots = atoi(v) > 1 ? atoi(v) : 1;
+        else if ((v = optionValue(argc, argv, i, "--trace"))) traceFile = v;
+        else if (strcmp(argv[i], "--perf") == 0) perfEnabled = true;
+        else if ((v = optionValue(argc, argv, i, "--shm"))) shmName = v;
+        else if ((v = optionValue(argc, argv, i, "--shm-slots"))) shmSlots = atoi(v) > 1 ? atoi(v) : 1;
+        else if (strcmp(argv[i], "--no-vbo") == 0) meshCache.useBuffers = false;
+        else if (strcmp(argv[i], "--no-instancing") == 0) instanceRenderer.useInstancing = false;
+    }
+    if (perfEnabled) atexit(finishPerf);
+    if (traceFile) {
+        traceEnable();
+        traceThreadName("main");
+        atexit(finishTrace);
+    }
+    if (frames >= 0) {
+        size_t len = strlen(out);
+        if (len > 4 && strcmp(out + len - 4, ".y4m") == 0) y4m = true;
+        FrameFormat format = y4m ? FRAME_Y4M : strcmp(out, "-") == 0 ? FRAME_RGB24 : FRAME_PPM;
+        return renderHeadless(frames, seed, out, format, writerSlots);
+    }
+
     glutInit(&argc, argv);
     glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
     glutInitWindowSize(windowWidth, windowHeight);
     glutCreateWindow("Railway Station");
-    initScene();
-    glutDisplayFunc(renderScene);
+    initScene(seed);
+    glutDisplayFunc(display);
     glutReshapeFunc(reshape);
     glutKeyboardFunc(keyboard);
-    glutTimerFunc(16, timerFunc, 0);
-    glClearColor(0.75f, 0.85f, 0.95f, 1.0f);
+    glutTimerFunc(TICK_MS, timerFunc, 0);
     glutMainLoop();
     return 0;
 }
-
+#endif
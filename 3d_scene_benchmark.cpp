@@ -0,0 +1,277 @@
+// Benchmarks for the 3D railway station.
+// COMPILE: g++ -O2 -pthread 3d_scene_benchmark.cpp -o station_bench -lGL -lGLU -lglut -lEGL -lm
+//
+// Times the Matrix4 kernels (the scalar triple loop against SSE and AVX,
+// and full products against the in-place affine translate, scale and
+// rotate) and whole frames rendered into an offscreen EGL context, with
+// instancing on the GPU and on the CPU and the mesh cache in vertex
+// buffers and in client-side arrays, with their draw calls per frame, and
+// writes one JSON record per case. With --baseline, each case is compared
+// against a stored run and the exit status is 1 when any median got slower
+// than --tolerance percent.
+#define STATION_NO_MAIN
+#include "3d_scene_CinematicStation.cpp"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+
+// ---------- Measurement ----------
+struct BenchResult {
+    std::string name;
+    double p50, p90, p99;   // ns per operation (per frame for frame cases)
+    long drawCalls = -1;    // GL draw calls per frame, for frame cases
+};
+
+std::vector<BenchResult> results;
+int sampleCount = 25;
+double minSampleNs = 2e6;   // each sample runs enough iterations to take >= 2 ms
+
+double percentile(std::vector<double> v, double q) {
+    std::sort(v.begin(), v.end());
+    size_t i = (size_t)std::min((double)v.size() - 1, q * (v.size() - 1) + 0.5);
+    return v[i];
+}
+
+template <class Fn>
+double timeIterations(Fn& fn, long iterations) {
+    auto t0 = std::chrono::steady_clock::now();
+    for (long i = 0; i < iterations; i++) fn();
+    auto t1 = std::chrono::steady_clock::now();
+    return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count();
+}
+
+template <class Fn>
+void runCase(const std::string& name, Fn fn) {
+    long iterations = 1;
+    while (timeIterations(fn, iterations) < minSampleNs && iterations < (1L << 30)) iterations *= 2;
+    std::vector<double> samples;
+    for (int s = 0; s < sampleCount; s++) samples.push_back(timeIterations(fn, iterations) / iterations);
+    results.push_back({ name, percentile(samples, 0.5), percentile(samples, 0.9), percentile(samples, 0.99) });
+    fprintf(stderr, "%s: %.2f ns/op\n", name.c_str(), results.back().p50);
+}
+
+// ---------- Matrix Kernels ----------
+// Each operation works through a ring of modelview-like matrices (a view
+// matrix times a rotation and translation), so the inputs are not
+// constants the compiler could fold. The full/ cases are the transforms as
+// they were before the in-place updates: build the factor, multiply with
+// the scalar kernel, copy back.
+const int MATRIX_RING = 256;
+Matrix4 matrixInputs[MATRIX_RING], matrixOutputs[MATRIX_RING];
+
+void fillMatrixInputs() {
+    srand(1);
+    for (int i = 0; i < MATRIX_RING; i++) {
+        Vec3 eye((float)(rand() % 200 - 100), (float)(rand() % 40), (float)(rand() % 200 - 100));
+        Matrix4 m = custom_look_at(eye, Vec3(0.0f, 2.5f, 0.0f), Vec3(0.0f, 1.0f, 0.0f));
+        m.rotate((float)(rand() % 360), 0.0f, 1.0f, 0.0f);
+        m.translate((float)(rand() % 100), 0.5f, (float)(rand() % 10));
+        matrixInputs[i] = m;
+    }
+}
+
+// Largest difference between the scalar reference and another kernel over
+// the ring, as a sanity check printed with the timings.
+template <class Kernel>
+float kernelDifference(Kernel kernel) {
+    float worst = 0.0f;
+    for (int i = 0; i < MATRIX_RING; i++) {
+        const Matrix4& a = matrixInputs[i];
+        const Matrix4& b = matrixInputs[(i + 1) % MATRIX_RING];
+        Matrix4 expected, got;
+        mat4MultiplyScalar(a, b, expected);
+        kernel(a, b, got);
+        for (int k = 0; k < 16; k++) worst = std::max(worst, fabsf(expected.m[k] - got.m[k]));
+    }
+    return worst;
+}
+
+void fullTranslate(Matrix4& m, float x, float y, float z) {
+    Matrix4 r;
+    mat4MultiplyScalar(m, Matrix4::createTranslation(x, y, z), r);
+    m = r;
+}
+void fullScale(Matrix4& m, float sx, float sy, float sz) {
+    Matrix4 r;
+    mat4MultiplyScalar(m, Matrix4::createScale(sx, sy, sz), r);
+    m = r;
+}
+void fullRotate(Matrix4& m, float angle, float x, float y, float z) {
+    Matrix4 r;
+    mat4MultiplyScalar(m, Matrix4::createRotation(angle, x, y, z), r);
+    m = r;
+}
+
+void benchMatrix() {
+    fillMatrixInputs();
+    static int i = 0;
+    auto next = [] { i = (i + 1) & (MATRIX_RING - 1); return i; };
+
+    runCase("matrix/multiply/scalar", [&next] {
+        int k = next();
+        mat4MultiplyScalar(matrixInputs[k], matrixInputs[(k + 7) & (MATRIX_RING - 1)], matrixOutputs[k]);
+    });
+#ifdef STATION_X86_SIMD
+    fprintf(stderr, "  sse differs from scalar by at most %g\n", kernelDifference(mat4MultiplySSE));
+    runCase("matrix/multiply/sse", [&next] {
+        int k = next();
+        mat4MultiplySSE(matrixInputs[k], matrixInputs[(k + 7) & (MATRIX_RING - 1)], matrixOutputs[k]);
+    });
+    if (__builtin_cpu_supports("avx")) {
+        fprintf(stderr, "  avx differs from scalar by at most %g\n", kernelDifference(mat4MultiplyAVX));
+        runCase("matrix/multiply/avx", [&next] {
+            int k = next();
+            mat4MultiplyAVX(matrixInputs[k], matrixInputs[(k + 7) & (MATRIX_RING - 1)], matrixOutputs[k]);
+        });
+    }
+    else fprintf(stderr, "CPU without AVX, skipping matrix/multiply/avx\n");
+#endif
+
+    // the affine updates in place against the full products
+    runCase("matrix/translate/full", [&next] { fullTranslate(matrixOutputs[next()], 4.0f, 0.1f, 0.0f); });
+    runCase("matrix/translate/affine", [&next] { matrixOutputs[next()].translate(4.0f, 0.1f, 0.0f); });
+    runCase("matrix/scale/full", [&next] { fullScale(matrixOutputs[next()], 1.0f, 0.15f, 5.0f); });
+    runCase("matrix/scale/affine", [&next] { matrixOutputs[next()].scale(1.0f, 0.15f, 5.0f); });
+    runCase("matrix/rotate/full", [&next] { fullRotate(matrixOutputs[next()], 30.0f, 0.0f, 1.0f, 0.0f); });
+    runCase("matrix/rotate/affine", [&next] { matrixOutputs[next()].rotate(30.0f, 0.0f, 1.0f, 0.0f); });
+
+    // one coach window from drawCoach, every frame: push, translate, scale, pop
+    runCase("matrix/window/full", [&next] {
+        int k = next();
+        Matrix4 m = matrixInputs[k];
+        fullTranslate(m, -5.5f + 3.0f * (k & 3), 0.2f, 1.55f);
+        fullScale(m, 1.8f, 0.9f, 0.06f);
+        matrixOutputs[k] = m;
+    });
+    runCase("matrix/window/affine", [&next] {
+        int k = next();
+        Matrix4 m = matrixInputs[k];
+        m.translate(-5.5f + 3.0f * (k & 3), 0.2f, 1.55f);
+        m.scale(1.8f, 0.9f, 0.06f);
+        matrixOutputs[k] = m;
+    });
+}
+
+// ---------- Frame Timing ----------
+// Whole frames in an offscreen pbuffer (Mesa's llvmpipe on a machine
+// without a GPU), stepping the scene between frames; glFinish makes the
+// time include the GL work, not just its submission.
+void benchFrames() {
+#ifdef STATION_HEADLESS_EGL
+    if (!createHeadlessContext(windowWidth, windowHeight)) {
+        fprintf(stderr, "No offscreen GL context, skipping frame/ cases\n");
+        return;
+    }
+    initScene(1);
+    reshape(windowWidth, windowHeight);
+    fprintf(stderr, "static world: %zu vertices\n", staticWorld.vertexCount());
+    for (int i = 0; i < 10; i++) { renderScene(); stepScene(); }
+    auto frameCase = [](const std::string& name) {
+        long before = glDrawCalls;
+        renderScene();
+        glFinish();
+        long calls = glDrawCalls - before;
+        runCase(name, [] { renderScene(); glFinish(); stepScene(); });
+        results.back().drawCalls = calls;
+        fprintf(stderr, "  %ld draw calls per frame\n", calls);
+    };
+    frameCase("frame/station");
+    // instances pre-transformed on the CPU, as with --no-instancing
+    instanceRenderer.useInstancing = false;
+    frameCase("frame/station/cpu-instances");
+    instanceRenderer.useInstancing = true;
+    // the cached meshes and the static world in client-side arrays, as
+    // with --no-vbo
+    meshCache.clear();
+    meshCache.useBuffers = false;
+    buildMeshes(meshCache);
+    bakeStaticWorld(meshCache);
+    frameCase("frame/station/client-arrays");
+    meshCache.clear();
+    meshCache.useBuffers = true;
+    buildMeshes(meshCache);
+    bakeStaticWorld(meshCache);
+#else
+    fprintf(stderr, "Built without EGL, skipping frame/ cases\n");
+#endif
+}
+
+// ---------- Output ----------
+// One case per line, fields in a fixed order, so two runs diff cleanly.
+bool writeJson(const std::string& path) {
+    std::ostringstream os;
+    os << "{\n  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& r = results[i];
+        os << "    {\"name\": \"" << r.name << "\", \"p50_ns\": " << r.p50 << ", \"p90_ns\": " << r.p90
+           << ", \"p99_ns\": " << r.p99;
+        if (r.name.compare(0, 6, "frame/") == 0) os << ", \"fps\": " << 1e9 / r.p50;
+        if (r.drawCalls >= 0) os << ", \"draw_calls\": " << r.drawCalls;
+        os << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    os << "  ]\n}\n";
+    if (path == "-") { fputs(os.str().c_str(), stdout); return true; }
+    std::ofstream f(path);
+    f << os.str();
+    return (bool)f;
+}
+
+// Reads name -> p50 back from a file written by writeJson.
+std::map<std::string, double> readBaseline(const std::string& path) {
+    std::map<std::string, double> base;
+    std::ifstream f(path);
+    std::string line;
+    while (std::getline(f, line)) {
+        size_t n = line.find("\"name\": \""), p = line.find("\"p50_ns\": ");
+        if (n == std::string::npos || p == std::string::npos) continue;
+        n += 9;
+        base[line.substr(n, line.find('"', n) - n)] = atof(line.c_str() + p + 10);
+    }
+    return base;
+}
+
+int compareBaseline(const std::string& path, double tolerance) {
+    std::map<std::string, double> base = readBaseline(path);
+    if (base.empty()) {
+        fprintf(stderr, "No results found in baseline %s\n", path.c_str());
+        return 1;
+    }
+    int regressions = 0;
+    for (const BenchResult& r : results) {
+        auto it = base.find(r.name);
+        if (it == base.end()) continue;
+        double change = (r.p50 - it->second) / it->second * 100.0;
+        bool slower = change > tolerance;
+        regressions += slower;
+        fprintf(stderr, "%-40s %12.1f -> %12.1f ns  %+7.1f%%%s\n", r.name.c_str(), it->second, r.p50, change,
+                slower ? "  REGRESSION" : "");
+    }
+    return regressions ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+    std::string out = "-", baseline, filter;
+    double tolerance = 10.0;
+    for (int i = 1; i < argc; i++) {
+        const char* v;
+        if ((v = optionValue(argc, argv, i, "--out"))) out = v;
+        else if ((v = optionValue(argc, argv, i, "--baseline"))) baseline = v;
+        else if ((v = optionValue(argc, argv, i, "--tolerance"))) tolerance = atof(v);
+        else if ((v = optionValue(argc, argv, i, "--samples"))) sampleCount = std::max(1, atoi(v));
+        else if ((v = optionValue(argc, argv, i, "--filter"))) filter = v;
+    }
+
+    auto selected = [&filter](const char* group) { return filter.empty() || filter.find(group) != std::string::npos; };
+    if (selected("matrix")) benchMatrix();
+    if (selected("frame")) benchFrames();
+
+    if (!writeJson(out)) {
+        fprintf(stderr, "Failed to write %s\n", out.c_str());
+        return 1;
+    }
+    return baseline.empty() ? 0 : compareBaseline(baseline, tolerance);
+}
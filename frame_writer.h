@@ -0,0 +1,275 @@
+// frame_writer.h
+// Asynchronous video frame writer shared by the 2D park and the 3D station.
+//
+// The renderer captures each frame into a slot of a bounded ring of
+// preallocated RGBA buffers and goes on with the next frame; a writer thread
+// converts the queued slots (RGB24, PPM or Y4M YUV420) and writes them out.
+// When the ring is full the renderer waits for a free slot instead of
+// dropping a frame, and the waits are counted so back-pressure is visible.
+#ifndef FRAME_WRITER_H
+#define FRAME_WRITER_H
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+#include "trace_events.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define FRAME_WRITER_SSE2 1
+#endif
+
+// ------------------- Pixel Conversion -------------------
+// Sources are RGBA8 pixels packed as R | G << 8 | B << 16 | A << 24 with row
+// 0 at the bottom, which is both the park's framebuffer layout and what
+// glReadPixels(GL_RGBA, GL_UNSIGNED_BYTE) returns. Outputs are top-down.
+
+inline void rgbaToRGB24(const uint32_t* src, int w, int h, unsigned char* dst) {
+    for (int y = h - 1; y >= 0; y--) {
+        const uint32_t* row = src + (size_t)y * w;
+        for (int x = 0; x < w; x++, dst += 3) {
+            dst[0] = row[x] & 0xFF; dst[1] = (row[x] >> 8) & 0xFF; dst[2] = (row[x] >> 16) & 0xFF;
+        }
+    }
+}
+
+// BT.601 studio range in 8-bit fixed point. Chroma is taken from the average
+// of each 2x2 block, centred between the four pixels (420jpeg siting). The
+// SSE2 path evaluates the same integer expressions, so both give identical
+// bytes.
+inline int lumaBT601(int r, int g, int b) { return ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16; }
+inline int cbBT601(int r, int g, int b) { return ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128; }
+inline int crBT601(int r, int g, int b) { return ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128; }
+
+#ifdef FRAME_WRITER_SSE2
+// Splits 8 pixels into 16-bit R, G and B lanes.
+inline void splitRGB(__m128i p0, __m128i p1, __m128i& r, __m128i& g, __m128i& b) {
+    const __m128i mask = _mm_set1_epi32(0xFF);
+    r = _mm_packs_epi32(_mm_and_si128(p0, mask), _mm_and_si128(p1, mask));
+    g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 8), mask), _mm_and_si128(_mm_srli_epi32(p1, 8), mask));
+    b = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 16), mask), _mm_and_si128(_mm_srli_epi32(p1, 16), mask));
+}
+
+// The luma sum peaks at 220 * 255 + 128, which fits an unsigned 16-bit lane.
+inline __m128i lumaLanes(__m128i r, __m128i g, __m128i b) {
+    __m128i sum = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(66)), _mm_mullo_epi16(g, _mm_set1_epi16(129))),
+                                _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(25)), _mm_set1_epi16(128)));
+    return _mm_add_epi16(_mm_srli_epi16(sum, 8), _mm_set1_epi16(16));
+}
+
+// Chroma sums stay within +-28560 + 128, so signed 16-bit lanes hold them.
+inline __m128i chromaLanes(__m128i r, __m128i g, __m128i b, short cr, short cg, short cb) {
+    __m128i sum = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(cr)), _mm_mullo_epi16(g, _mm_set1_epi16(cg))),
+                                _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(cb)), _mm_set1_epi16(128)));
+    return _mm_add_epi16(_mm_srai_epi16(sum, 8), _mm_set1_epi16(128));
+}
+
+// Sums each horizontal pair of 16 lanes (two rows already added) and
+// averages the 2x2 block: 8 lanes out.
+inline __m128i blockAverage(__m128i left, __m128i right) {
+    const __m128i ones = _mm_set1_epi16(1);
+    __m128i sums = _mm_packs_epi32(_mm_madd_epi16(left, ones), _mm_madd_epi16(right, ones));
+    return _mm_srli_epi16(_mm_add_epi16(sums, _mm_set1_epi16(2)), 2);
+}
+#endif
+
+inline void rgbaToYUV420(const uint32_t* src, int w, int h, unsigned char* yPlane, unsigned char* uPlane, unsigned char* vPlane) {
+    int cw = (w + 1) / 2;
+    for (int cy = 0; cy < (h + 1) / 2; cy++) {
+        // output rows 2cy and 2cy + 1 (top-down); an odd last row pairs with itself
+        int row0 = 2 * cy, row1 = std::min(2 * cy + 1, h - 1);
+        const uint32_t* a = src + (size_t)(h - 1 - row0) * w;
+        const uint32_t* b = src + (size_t)(h - 1 - row1) * w;
+        unsigned char* ya = yPlane + (size_t)row0 * w;
+        unsigned char* yb = yPlane + (size_t)row1 * w;
+        unsigned char* u = uPlane + (size_t)cy * cw;
+        unsigned char* v = vPlane + (size_t)cy * cw;
+        int x = 0;
+#ifdef FRAME_WRITER_SSE2
+        for (; x + 16 <= w; x += 16) {
+            __m128i ra[2], ga[2], ba[2], rb[2], gb[2], bb[2];
+            for (int k = 0; k < 2; k++) {
+                splitRGB(_mm_loadu_si128((const __m128i*)(a + x + 8 * k)), _mm_loadu_si128((const __m128i*)(a + x + 8 * k + 4)), ra[k], ga[k], ba[k]);
+                splitRGB(_mm_loadu_si128((const __m128i*)(b + x + 8 * k)), _mm_loadu_si128((const __m128i*)(b + x + 8 * k + 4)), rb[k], gb[k], bb[k]);
+            }
+            _mm_storeu_si128((__m128i*)(ya + x), _mm_packus_epi16(lumaLanes(ra[0], ga[0], ba[0]), lumaLanes(ra[1], ga[1], ba[1])));
+            if (row1 != row0)
+                _mm_storeu_si128((__m128i*)(yb + x), _mm_packus_epi16(lumaLanes(rb[0], gb[0], bb[0]), lumaLanes(rb[1], gb[1], bb[1])));
+            __m128i r = blockAverage(_mm_add_epi16(ra[0], rb[0]), _mm_add_epi16(ra[1], rb[1]));
+            __m128i g = blockAverage(_mm_add_epi16(ga[0], gb[0]), _mm_add_epi16(ga[1], gb[1]));
+            __m128i bl = blockAverage(_mm_add_epi16(ba[0], bb[0]), _mm_add_epi16(ba[1], bb[1]));
+            _mm_storel_epi64((__m128i*)(u + x / 2), _mm_packus_epi16(chromaLanes(r, g, bl, -38, -74, 112), _mm_setzero_si128()));
+            _mm_storel_epi64((__m128i*)(v + x / 2), _mm_packus_epi16(chromaLanes(r, g, bl, 112, -94, -18), _mm_setzero_si128()));
+        }
+#endif
+        for (; x < w; x += 2) {
+            int x1 = std::min(x + 1, w - 1);
+            uint32_t p[4] = { a[x], a[x1], b[x], b[x1] };
+            int rs = 0, gs = 0, bs = 0;
+            for (uint32_t q : p) { rs += q & 0xFF; gs += (q >> 8) & 0xFF; bs += (q >> 16) & 0xFF; }
+            ya[x] = lumaBT601(p[0] & 0xFF, (p[0] >> 8) & 0xFF, (p[0] >> 16) & 0xFF);
+            ya[x1] = lumaBT601(p[1] & 0xFF, (p[1] >> 8) & 0xFF, (p[1] >> 16) & 0xFF);
+            yb[x] = lumaBT601(p[2] & 0xFF, (p[2] >> 8) & 0xFF, (p[2] >> 16) & 0xFF);
+            yb[x1] = lumaBT601(p[3] & 0xFF, (p[3] >> 8) & 0xFF, (p[3] >> 16) & 0xFF);
+            int r = (rs + 2) >> 2, g = (gs + 2) >> 2, bl = (bs + 2) >> 2;
+            u[x / 2] = cbBT601(r, g, bl);
+            v[x / 2] = crBT601(r, g, bl);
+        }
+    }
+}
+
+// ------------------- Frame Writer -------------------
+enum FrameFormat {
+    FRAME_RGB24,   // raw top-down RGB24 stream, for ffmpeg -f rawvideo
+    FRAME_PPM,     // one <dir>/frame_NNNNN.ppm per frame
+    FRAME_Y4M      // YUV4MPEG2 stream, 4:2:0
+};
+
+struct FrameWriterStats {
+    uint64_t frames = 0;          // frames written
+    uint64_t producerStalls = 0;  // acquireSlot calls that found the ring full
+    double producerStallMs = 0;   // time the renderer spent waiting for a slot
+    uint64_t writerStalls = 0;    // times the writer found the ring empty
+    int peakQueued = 0;           // most slots queued at once
+};
+
+class FrameWriter {
+public:
+    ~FrameWriter() { close(); }
+
+    // Opens "-" (stdout), a file or, for FRAME_PPM, a directory and starts
+    // the writer thread. fpsNum / fpsDen is the Y4M frame rate.
+    bool open(FrameFormat format, const char* out, int width, int height, int fpsNum, int fpsDen, int slots = 4) {
+        fmt = format;
+        w = width; h = height;
+        path = out;
+        if (fmt == FRAME_PPM) mkdir(out, 0755);
+        else if (strcmp(out, "-") == 0) file = stdout;
+        else if (!(file = fopen(out, "wb"))) return false;
+        if (fmt == FRAME_Y4M && fprintf(file, "YUV4MPEG2 W%d H%d F%d:%d Ip A1:1 C420jpeg\n", w, h, fpsNum, fpsDen) < 0) failed = true;
+        ring.assign(std::max(slots, 1), std::vector<uint32_t>((size_t)w * h));
+        queued = written = 0;
+        stats = FrameWriterStats();
+        closing = false;
+        writer = std::thread(&FrameWriter::writerLoop, this);
+        return true;
+    }
+
+    // Returns the next free slot (w * h RGBA pixels, bottom row first) and
+    // blocks while every slot is still queued.
+    uint32_t* acquireSlot() {
+        std::unique_lock<std::mutex> lock(m);
+        if (queued - written == ring.size()) {
+            TRACE_SCOPE("wait for writer slot");
+            auto start = std::chrono::steady_clock::now();
+            stats.producerStalls++;
+            changed.wait(lock, [this] { return queued - written < ring.size(); });
+            stats.producerStallMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        }
+        return ring[queued % ring.size()].data();
+    }
+
+    // Queues the slot returned by acquireSlot for writing.
+    void submitSlot() {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            queued++;
+            stats.peakQueued = std::max(stats.peakQueued, (int)(queued - written));
+            traceCounter("writer queue", (int64_t)(queued - written));
+        }
+        changed.notify_all();
+    }
+
+    bool ok() {
+        std::lock_guard<std::mutex> lock(m);
+        return !failed;
+    }
+
+    // Writes out everything still queued and stops the writer thread.
+    // Returns false if any frame failed to write.
+    bool close() {
+        if (!writer.joinable()) return !failed;
+        { std::lock_guard<std::mutex> lock(m); closing = true; }
+        changed.notify_all();
+        writer.join();
+        if (file && (file == stdout ? fflush(file) : fclose(file)) != 0) failed = true;
+        file = nullptr;
+        return !failed;
+    }
+
+    FrameWriterStats counters() {
+        std::lock_guard<std::mutex> lock(m);
+        return stats;
+    }
+
+    void printCounters(FILE* to) {
+        FrameWriterStats s = counters();
+        fprintf(to, "frame writer: %llu frames, %d slots, peak %d queued, renderer waited %llu times (%.1f ms), writer idle %llu times\n",
+                (unsigned long long)s.frames, (int)ring.size(), s.peakQueued, (unsigned long long)s.producerStalls,
+                s.producerStallMs, (unsigned long long)s.writerStalls);
+    }
+
+private:
+    FrameFormat fmt = FRAME_RGB24;
+    int w = 0, h = 0;
+    std::string path;
+    FILE* file = nullptr;
+    std::vector<std::vector<uint32_t>> ring;
+    std::vector<unsigned char> encoded;   // writer thread only
+    std::mutex m;
+    std::condition_variable changed;
+    size_t queued = 0, written = 0;
+    bool closing = false, failed = false;
+    FrameWriterStats stats;
+    std::thread writer;
+
+    void writerLoop() {
+        traceThreadName("frame writer");
+        for (;;) {
+            const uint32_t* pixels;
+            {
+                std::unique_lock<std::mutex> lock(m);
+                if (queued == written && !closing) stats.writerStalls++;
+                changed.wait(lock, [this] { return closing || queued > written; });
+                if (queued == written) return;
+                pixels = ring[written % ring.size()].data();
+            }
+            bool ok = writeFrame(pixels);
+            {
+                std::lock_guard<std::mutex> lock(m);
+                if (!ok) failed = true;
+                written++;
+                stats.frames++;
+            }
+            changed.notify_all();
+        }
+    }
+
+    bool writeFrame(const uint32_t* pixels) {
+        TRACE_FUNCTION();
+        if (fmt == FRAME_Y4M) {
+            size_t lumaSize = (size_t)w * h, chromaSize = (size_t)((w + 1) / 2) * ((h + 1) / 2);
+            encoded.resize(lumaSize + 2 * chromaSize);
+            rgbaToYUV420(pixels, w, h, encoded.data(), encoded.data() + lumaSize, encoded.data() + lumaSize + chromaSize);
+            return fputs("FRAME\n", file) >= 0 && fwrite(encoded.data(), 1, encoded.size(), file) == encoded.size();
+        }
+        encoded.resize((size_t)w * h * 3);
+        rgbaToRGB24(pixels, w, h, encoded.data());
+        if (fmt == FRAME_RGB24) return fwrite(encoded.data(), 1, encoded.size(), file) == encoded.size();
+        char name[4096];
+        snprintf(name, sizeof(name), "%s/frame_%05llu.ppm", path.c_str(), (unsigned long long)stats.frames);
+        FILE* f = fopen(name, "wb");
+        bool ok = f && fprintf(f, "P6\n%d %d\n255\n", w, h) > 0 && fwrite(encoded.data(), 1, encoded.size(), f) == encoded.size();
+        if (f && fclose(f) != 0) ok = false;
+        return ok;
+    }
+};
+
+#endif
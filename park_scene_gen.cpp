@@ -0,0 +1,62 @@
+// park_scene_gen.cpp
+// Writes scene files for `park_2d --scene=FILE` (format in scene_file.h).
+// COMPILE: g++ -O2 park_scene_gen.cpp -o park_scene_gen
+//
+//   park_scene_gen --builtin --out park.scene           the park's own layout
+//   park_scene_gen --objects 100000 --out 100k.scene    a stress scene
+//
+// Stress scenes take --seed N, --animated P (percent of the ground objects
+// that are Ferris wheels, default 10) and --control-points N (coaster
+// points, default 6).
+
+#include "scene_file.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// Accepts "--name value" and "--name=value"; returns nullptr if argv[i] is
+// not that option.
+const char* optionValue(int argc, char** argv, int& i, const char* name) {
+    size_t len = strlen(name);
+    if (strncmp(argv[i], name, len) != 0) return nullptr;
+    if (argv[i][len] == '=') return argv[i] + len + 1;
+    if (argv[i][len] == '\0' && i + 1 < argc) return argv[++i];
+    return nullptr;
+}
+
+int main(int argc, char** argv) {
+    const char* out = nullptr;
+    long objects = 10000;
+    unsigned int seed = 1;
+    int animatedPercent = 10, controlPoints = 6;
+    bool builtin = false;
+    for (int i = 1; i < argc; i++) {
+        const char* v;
+        if (strcmp(argv[i], "--builtin") == 0) builtin = true;
+        else if ((v = optionValue(argc, argv, i, "--objects"))) objects = atol(v);
+        else if ((v = optionValue(argc, argv, i, "--seed"))) seed = (unsigned int)strtoul(v, nullptr, 10);
+        else if ((v = optionValue(argc, argv, i, "--animated"))) animatedPercent = atoi(v);
+        else if ((v = optionValue(argc, argv, i, "--control-points"))) controlPoints = atoi(v);
+        else if ((v = optionValue(argc, argv, i, "--out"))) out = v;
+        else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (!out || objects < 0 || objects > 100000000) {
+        fprintf(stderr, "usage: park_scene_gen (--builtin | --objects N [--seed N] [--animated P] "
+                        "[--control-points N]) --out FILE\n");
+        return 1;
+    }
+
+    std::vector<SceneObject> sceneObjects;
+    std::vector<SceneControlPoint> sceneControlPoints;
+    if (builtin) builtinScene(sceneObjects, sceneControlPoints);
+    else stressScene((uint32_t)objects, seed, animatedPercent, controlPoints, sceneObjects, sceneControlPoints);
+    if (!writeSceneFile(out, sceneObjects, sceneControlPoints)) {
+        fprintf(stderr, "Could not write %s\n", out);
+        return 1;
+    }
+    fprintf(stderr, "%s: %zu objects, %zu control points\n", out, sceneObjects.size(), sceneControlPoints.size());
+    return 0;
+}
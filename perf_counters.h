@@ -0,0 +1,237 @@
+// perf_counters.h
+// Hardware performance counters per render stage, shared by the 2D park and
+// the 3D station (Linux perf_event_open).
+//
+//     PerfStage perfBlend("blend", "pixel");
+//     ...
+//     { PERF_SCOPE(perfBlend, n); blendSpan(p, n, color, mode); }
+//
+// Each thread opens one counter group (cycles, instructions, cache misses,
+// branch misses, user space only) the first time it enters a scope, and a
+// scope reads the group on entry and exit. Counts are exclusive: a scope
+// nested in another is subtracted from its parent, so the stages add up to
+// the instrumented total. Where the hardware counters cannot be opened (no
+// PMU in a VM, or kernel.perf_event_paranoid too high) the software task
+// clock and page faults are counted instead, and failing that only wall
+// time. Reading costs a system call per scope boundary, part of which
+// lands in the enclosing stage, so small stages look slower than they are:
+// compare IPC and misses per unit, not wall time against an uninstrumented
+// run. This is an opt-in profiling mode; while it is off a scope is one
+// branch.
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <vector>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define PERF_COUNTERS_LINUX 1
+#endif
+
+const int PERF_MAX_COUNTERS = 4;
+
+struct PerfStage {
+    const char* name;
+    const char* unit;   // what the per-unit columns are divided by
+    std::atomic<uint64_t> calls{ 0 }, units{ 0 }, ns{ 0 };
+    std::atomic<uint64_t> counts[PERF_MAX_COUNTERS] = {};
+
+    PerfStage(const char* stageName, const char* unitName);
+};
+
+inline bool perfEnabled = false;
+inline std::mutex perfMutex;
+inline std::vector<PerfStage*> perfStages;
+// Decided by the first thread to open its counters; the other threads
+// open the same set.
+inline int perfCounterCount = -1;
+inline const char* perfCounterNames[PERF_MAX_COUNTERS];
+inline bool perfHardware = false;
+inline std::string perfUnavailable;   // why the hardware counters could not be opened
+
+inline PerfStage::PerfStage(const char* stageName, const char* unitName) : name(stageName), unit(unitName) {
+    std::lock_guard<std::mutex> lock(perfMutex);
+    perfStages.push_back(this);
+}
+
+inline uint64_t perfWallNs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#ifdef PERF_COUNTERS_LINUX
+struct PerfEventSpec { uint32_t type; uint64_t config; const char* name; };
+
+const PerfEventSpec PERF_HARDWARE_EVENTS[PERF_MAX_COUNTERS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles" },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions" },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache-misses" },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch-misses" },
+};
+const PerfEventSpec PERF_SOFTWARE_EVENTS[2] = {
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, "task-clock-ns" },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, "page-faults" },
+};
+
+inline int perfOpen(const PerfEventSpec& spec, int groupFd) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = spec.type;
+    attr.config = spec.config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, groupFd, 0);
+}
+
+// Opens all of events as one group on the calling thread; returns the
+// leader's fd, or -1 with every fd closed.
+inline int perfOpenGroup(const PerfEventSpec* events, int count) {
+    int fds[PERF_MAX_COUNTERS];
+    for (int i = 0; i < count; i++) {
+        fds[i] = perfOpen(events[i], i == 0 ? -1 : fds[0]);
+        if (fds[i] < 0) {
+            int err = errno;
+            while (i-- > 0) close(fds[i]);
+            errno = err;
+            return -1;
+        }
+    }
+    return fds[0];
+}
+#endif
+
+// The calling thread's counter group: leader fd, or -1 for wall time only.
+inline int perfThreadGroup() {
+    thread_local int group = -2;
+    if (group != -2) return group;
+    group = -1;
+#ifdef PERF_COUNTERS_LINUX
+    std::lock_guard<std::mutex> lock(perfMutex);
+    if (perfCounterCount < 0) {
+        group = perfOpenGroup(PERF_HARDWARE_EVENTS, PERF_MAX_COUNTERS);
+        if (group >= 0) {
+            perfHardware = true;
+            perfCounterCount = PERF_MAX_COUNTERS;
+            for (int i = 0; i < PERF_MAX_COUNTERS; i++) perfCounterNames[i] = PERF_HARDWARE_EVENTS[i].name;
+            return group;
+        }
+        int err = errno;
+        perfUnavailable = strerror(err);
+        if (err == ENOENT || err == EOPNOTSUPP) perfUnavailable += " (no hardware PMU exposed, e.g. in a VM)";
+        else if (err == EACCES || err == EPERM) perfUnavailable += " (lower kernel.perf_event_paranoid or grant CAP_PERFMON)";
+        group = perfOpenGroup(PERF_SOFTWARE_EVENTS, 2);
+        perfCounterCount = group >= 0 ? 2 : 0;
+        for (int i = 0; i < perfCounterCount; i++) perfCounterNames[i] = PERF_SOFTWARE_EVENTS[i].name;
+        return group;
+    }
+    if (perfCounterCount > 0) group = perfOpenGroup(perfHardware ? PERF_HARDWARE_EVENTS : PERF_SOFTWARE_EVENTS, perfCounterCount);
+#endif
+    return group;
+}
+
+// Slot 0 is wall time, 1.. the counters.
+struct PerfSample { uint64_t v[PERF_MAX_COUNTERS + 1]; };
+
+inline void perfRead(int group, PerfSample& s) {
+    s = PerfSample();
+#ifdef PERF_COUNTERS_LINUX
+    if (group >= 0) {
+        uint64_t buf[PERF_MAX_COUNTERS + 1];
+        if (read(group, buf, sizeof(buf)) > 0)
+            for (uint64_t i = 0; i < buf[0] && i < (uint64_t)PERF_MAX_COUNTERS; i++) s.v[i + 1] = buf[i + 1];
+    }
+#endif
+    s.v[0] = perfWallNs();
+}
+
+class PerfScope {
+public:
+    PerfScope(PerfStage& stage, uint64_t units) {
+        if (__builtin_expect(perfEnabled, 0)) begin(stage, units);
+    }
+    ~PerfScope() {
+        if (stage) end();
+    }
+    PerfScope(const PerfScope&) = delete;
+    PerfScope& operator=(const PerfScope&) = delete;
+
+private:
+    PerfStage* stage = nullptr;
+    PerfScope* parent = nullptr;
+    int group = -1;
+    PerfSample start, nested;
+
+    static PerfScope*& top() {
+        thread_local PerfScope* current = nullptr;
+        return current;
+    }
+
+    void begin(PerfStage& s, uint64_t units) {
+        stage = &s;
+        group = perfThreadGroup();
+        parent = top();
+        top() = this;
+        s.calls.fetch_add(1, std::memory_order_relaxed);
+        s.units.fetch_add(units, std::memory_order_relaxed);
+        nested = PerfSample();
+        perfRead(group, start);
+    }
+
+    void end() {
+        PerfSample now;
+        perfRead(group, now);
+        top() = parent;
+        for (int i = 0; i <= PERF_MAX_COUNTERS; i++) {
+            uint64_t total = now.v[i] - start.v[i];
+            uint64_t self = total > nested.v[i] ? total - nested.v[i] : 0;
+            if (i == 0) stage->ns.fetch_add(self, std::memory_order_relaxed);
+            else stage->counts[i - 1].fetch_add(self, std::memory_order_relaxed);
+            if (parent) parent->nested.v[i] += total;
+        }
+    }
+};
+
+#define PERF_CONCAT_(a, b) a##b
+#define PERF_CONCAT(a, b) PERF_CONCAT_(a, b)
+#define PERF_SCOPE(stage, units) PerfScope PERF_CONCAT(perfScope, __LINE__)(stage, units)
+
+// Prints one line per stage that ran: calls, units, exclusive wall time,
+// and each counter per unit (plus IPC with the hardware counters).
+inline void printPerfReport(FILE* to) {
+    std::lock_guard<std::mutex> lock(perfMutex);
+    int n = perfCounterCount > 0 ? perfCounterCount : 0;
+    if (!perfHardware)
+        fprintf(to, "perf: hardware counters unavailable: %s; %s\n",
+                perfUnavailable.empty() ? "not supported on this platform" : perfUnavailable.c_str(),
+                n ? "showing software counters" : "showing wall time only");
+    fprintf(to, "%-18s %10s %12s %-8s %10s", "stage", "calls", "units", "unit", "ms");
+    if (perfHardware) fprintf(to, " %6s", "IPC");
+    for (int i = 0; i < n; i++) fprintf(to, " %16s/unit", perfCounterNames[i]);
+    fprintf(to, "\n");
+    for (PerfStage* s : perfStages) {
+        uint64_t calls = s->calls.load(), units = s->units.load();
+        if (!calls) continue;
+        fprintf(to, "%-18s %10llu %12llu %-8s %10.2f", s->name, (unsigned long long)calls, (unsigned long long)units,
+                s->unit, s->ns.load() / 1e6);
+        if (perfHardware) {
+            uint64_t cycles = s->counts[0].load();
+            fprintf(to, " %6.2f", cycles ? (double)s->counts[1].load() / cycles : 0.0);
+        }
+        for (int i = 0; i < n; i++) fprintf(to, " %21.3f", units ? (double)s->counts[i].load() / units : 0.0);
+        fprintf(to, "\n");
+    }
+}
+
+#endif
@@ -0,0 +1,267 @@
+// scene_file.h
+// Binary scene description for the 2D park: read by
+// 2d_scene_amusement_park.cpp (--scene=FILE), written by park_scene_gen.cpp
+// and the benchmark.
+//
+// A file is a SceneFileHeader followed by fixed-size SceneObject records and
+// the roller coaster's control points, all little-endian and 8-byte
+// aligned. The park maps the file read-only and draws the records in
+// place: loading costs one mmap and one validation pass, with no
+// allocation per object, so a million-object park loads as fast as the
+// page cache can supply it.
+#ifndef SCENE_FILE_H
+#define SCENE_FILE_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const char SCENE_FILE_MAGIC[8] = { 'P', 'A', 'R', 'K', 'S', 'C', 'N', '1' };
+const uint32_t SCENE_FILE_VERSION = 1;
+
+// Each type is drawn by the park's own element function, placed so that
+// the object's (x, y) is its anchor: the foot of trees, tents, houses and
+// the Ferris wheel, the ground contact of cars, the centre of birds,
+// clouds and stars.
+enum SceneObjectType : uint8_t {
+    SCENE_TREE,
+    SCENE_TENT,            // with its waving flag
+    SCENE_HOUSE,           // with its waving flag
+    SCENE_CAR,             // moves along x
+    SCENE_BIRD,            // moves along x
+    SCENE_CLOUD,           // moves along x, drawn by day
+    SCENE_FERRIS_WHEEL,    // rotates
+    SCENE_STAR,            // drawn at night
+    SCENE_TYPE_COUNT
+};
+
+struct SceneFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t objectCount;
+    uint32_t controlPointCount;   // 0 keeps the park's own coaster track
+    uint32_t reserved;
+    uint64_t objectsOffset;
+    uint64_t controlPointsOffset;
+};
+
+struct SceneObject {
+    uint8_t type;         // SceneObjectType
+    uint8_t variant;      // car: 0 red body, 1 blue body
+    uint8_t reserved[2];
+    uint32_t color;       // tint multiplied into every colour, packed R | G << 8 | B << 16 | A << 24; 0 = none
+    float x, y;           // anchor in scene units (900 x 700)
+    float scale;          // uniform, about the anchor
+    float rotation;       // degrees counter-clockwise about the anchor
+    float speed;          // scene units per tick along x, or degrees per tick for the wheel
+    float phase;          // ticks added to the animation clock
+};
+
+struct SceneControlPoint { int32_t x, y; };
+
+static_assert(sizeof(SceneFileHeader) == 40, "scene header layout");
+static_assert(sizeof(SceneObject) == 32, "scene object layout");
+static_assert(sizeof(SceneControlPoint) == 8, "scene control point layout");
+
+// A read-only mapping of a scene file. objects and controlPoints point into
+// the mapping and stay valid until close().
+class SceneFile {
+public:
+    const SceneObject* objects = nullptr;
+    uint32_t objectCount = 0;
+    const SceneControlPoint* controlPoints = nullptr;
+    uint32_t controlPointCount = 0;
+
+    ~SceneFile() { close(); }
+
+    bool isOpen() const { return data != nullptr; }
+
+    // Maps and validates path; on failure returns false with error set.
+    bool open(const char* path, std::string& error) {
+        close();
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) { error = std::string(path) + ": " + strerror(errno); return false; }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(SceneFileHeader)) {
+            ::close(fd);
+            error = std::string(path) + ": too short for a scene file";
+            return false;
+        }
+        size = (size_t)st.st_size;
+        void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED) { error = std::string(path) + ": mmap failed"; return false; }
+        data = (const char*)mapping;
+        madvise(mapping, size, MADV_SEQUENTIAL);
+        if (!validate(error)) {
+            error = std::string(path) + ": " + error;
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+        if (data) munmap((void*)data, size);
+        data = nullptr;
+        size = 0;
+        objects = nullptr; objectCount = 0;
+        controlPoints = nullptr; controlPointCount = 0;
+    }
+
+private:
+    const char* data = nullptr;
+    size_t size = 0;
+
+    bool fits(uint64_t offset, uint64_t count, uint64_t recordSize) const {
+        return offset % 8 == 0 && offset <= size && count <= (size - offset) / recordSize;
+    }
+
+    bool validate(std::string& error) {
+        const SceneFileHeader* h = (const SceneFileHeader*)data;
+        if (memcmp(h->magic, SCENE_FILE_MAGIC, sizeof(SCENE_FILE_MAGIC)) != 0) { error = "not a park scene file"; return false; }
+        if (h->version != SCENE_FILE_VERSION) { error = "unsupported version " + std::to_string(h->version); return false; }
+        if (!fits(h->objectsOffset, h->objectCount, sizeof(SceneObject)) ||
+            !fits(h->controlPointsOffset, h->controlPointCount, sizeof(SceneControlPoint))) {
+            error = "records run past the end of the file";
+            return false;
+        }
+        if (h->controlPointCount == 1) { error = "a coaster track needs at least two control points"; return false; }
+        objects = (const SceneObject*)(data + h->objectsOffset);
+        objectCount = h->objectCount;
+        controlPoints = (const SceneControlPoint*)(data + h->controlPointsOffset);
+        controlPointCount = h->controlPointCount;
+        for (uint32_t i = 0; i < objectCount; i++) {
+            const SceneObject& o = objects[i];
+            if (o.type >= SCENE_TYPE_COUNT || !std::isfinite(o.x) || !std::isfinite(o.y) || !std::isfinite(o.scale) ||
+                !std::isfinite(o.rotation) || !std::isfinite(o.speed) || !std::isfinite(o.phase) ||
+                fabsf(o.x) > 1e6f || fabsf(o.y) > 1e6f || !(o.scale > 0 && o.scale <= 100)) {
+                error = "object " + std::to_string(i) + " is invalid";
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// Writes a complete scene file; returns false if it could not be written.
+inline bool writeSceneFile(const char* path, const std::vector<SceneObject>& objects,
+                           const std::vector<SceneControlPoint>& controlPoints) {
+    SceneFileHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SCENE_FILE_MAGIC, sizeof(h.magic));
+    h.version = SCENE_FILE_VERSION;
+    h.objectCount = (uint32_t)objects.size();
+    h.controlPointCount = (uint32_t)controlPoints.size();
+    h.objectsOffset = sizeof(SceneFileHeader);
+    h.controlPointsOffset = h.objectsOffset + objects.size() * sizeof(SceneObject);
+    FILE* f = fopen(path, "wb");
+    if (!f) return false;
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+              fwrite(objects.data(), sizeof(SceneObject), objects.size(), f) == objects.size() &&
+              fwrite(controlPoints.data(), sizeof(SceneControlPoint), controlPoints.size(), f) == controlPoints.size();
+    return fclose(f) == 0 && ok;
+}
+
+inline SceneObject makeSceneObject(SceneObjectType type, float x, float y, float scale = 1, float rotation = 0,
+                                   float speed = 0, float phase = 0, uint32_t color = 0, uint8_t variant = 0) {
+    SceneObject o;
+    memset(&o, 0, sizeof(o));
+    o.type = type; o.variant = variant; o.color = color;
+    o.x = x; o.y = y; o.scale = scale; o.rotation = rotation; o.speed = speed; o.phase = phase;
+    return o;
+}
+
+// The park's own layout: two trees, a tent, a house, the Ferris wheel, two
+// cars, three birds, two clouds and the six-point coaster track.
+inline void builtinScene(std::vector<SceneObject>& objects, std::vector<SceneControlPoint>& controlPoints) {
+    objects = {
+        makeSceneObject(SCENE_TENT, 200, 150),
+        makeSceneObject(SCENE_HOUSE, 500, 150),
+        makeSceneObject(SCENE_TREE, 60, 150),
+        makeSceneObject(SCENE_TREE, 310, 150),
+        makeSceneObject(SCENE_FERRIS_WHEEL, 700, 150, 1, 0, 3),
+        makeSceneObject(SCENE_CLOUD, 50, 600, 1, 0, 1),
+        makeSceneObject(SCENE_CLOUD, 350, 550, 1, 0, 1),
+        makeSceneObject(SCENE_CAR, 60, 90, 1, 0, 3),
+        makeSceneObject(SCENE_CAR, 1060, 90, 1, 0, -3, 0, 0, 1),
+        makeSceneObject(SCENE_BIRD, 900, 600, 1, 0, -4),
+        makeSceneObject(SCENE_BIRD, 960, 620, 1, 0, -4),
+        makeSceneObject(SCENE_BIRD, 1020, 610, 1, 0, -4),
+    };
+    controlPoints = { { 50, 200 }, { 150, 300 }, { 300, 500 }, { 450, 350 }, { 600, 180 }, { 800, 250 } };
+}
+
+// A crowded park of objectCount objects: trees, tents, houses and Ferris
+// wheels on the ground, cars on the road, birds, clouds and stars in the
+// sky, and a coaster of controlPointCount points across the park.
+// animatedPercent of the ground objects are wheels; cars, birds and clouds
+// always move. Scales, tilts and speeds come in coarse steps so that the
+// park's sprite cache sees a bounded set of transforms, and ground objects
+// are sorted back to front.
+inline void stressScene(uint32_t objectCount, unsigned int seed, int animatedPercent, int controlPointCount,
+                        std::vector<SceneObject>& objects, std::vector<SceneControlPoint>& controlPoints) {
+    std::mt19937 rng(seed);
+    auto uniform = [&rng](float lo, float hi) { return std::uniform_real_distribution<float>(lo, hi)(rng); };
+    auto pick = [&rng](int lo, int hi) { return std::uniform_int_distribution<int>(lo, hi)(rng); };
+    auto stepped = [&pick](float lo, float step, int steps) { return lo + step * pick(0, steps); };
+    auto randomColor = [&pick]() {
+        return (uint32_t)pick(64, 255) | (uint32_t)pick(64, 255) << 8 | (uint32_t)pick(64, 255) << 16 | 0xFF000000u;
+    };
+    objects.clear();
+    objects.reserve(objectCount);
+    for (uint32_t i = 0; i < objectCount; i++) {
+        int kind = pick(0, 99);
+        if (kind < 10) {
+            float speed = (float)(pick(1, 4) * (pick(0, 1) ? 1 : -1));
+            objects.push_back(makeSceneObject(SCENE_CAR, uniform(-200, 1100), uniform(60, 100), stepped(0.3f, 0.1f, 4), 0,
+                                              speed, 0, 0, (uint8_t)pick(0, 1)));
+        }
+        else if (kind < 20) {
+            objects.push_back(makeSceneObject(SCENE_BIRD, uniform(-200, 1100), uniform(450, 680), stepped(0.5f, 0.25f, 3), 0,
+                                              (float)-pick(1, 5)));
+        }
+        else if (kind < 25) {
+            objects.push_back(makeSceneObject(SCENE_CLOUD, uniform(-200, 1100), uniform(500, 680), stepped(0.5f, 0.25f, 4), 0,
+                                              stepped(0.25f, 0.25f, 5)));
+        }
+        else if (kind < 40) {
+            objects.push_back(makeSceneObject(SCENE_STAR, uniform(0, 900), uniform(400, 700)));
+        }
+        else {
+            float x = uniform(-50, 950), y = uniform(110, 260), scale = stepped(0.1f, 0.05f, 8);
+            if (pick(0, 99) < animatedPercent) {
+                objects.push_back(makeSceneObject(SCENE_FERRIS_WHEEL, x, y, scale, 0, (float)pick(1, 4), (float)pick(0, 119)));
+            }
+            else {
+                SceneObjectType type = (SceneObjectType)pick(SCENE_TREE, SCENE_HOUSE);
+                float tilt = 5.0f * pick(-1, 1);
+                objects.push_back(makeSceneObject(type, x, y, scale, tilt, 0, (float)pick(0, 59),
+                                                  pick(0, 1) ? randomColor() : 0));
+            }
+        }
+    }
+    // ground objects first, back (higher up) to front
+    auto onGround = [](const SceneObject& o) { return o.type <= SCENE_HOUSE || o.type == SCENE_FERRIS_WHEEL; };
+    std::stable_sort(objects.begin(), objects.end(), [&onGround](const SceneObject& a, const SceneObject& b) {
+        if (onGround(a) != onGround(b)) return onGround(a);
+        return onGround(a) && a.y > b.y;
+    });
+    controlPoints.clear();
+    int n = std::max(controlPointCount, 2);
+    for (int i = 0; i < n; i++)
+        controlPoints.push_back({ 30 + 840 * i / (n - 1), pick(180, 500) });
+}
+
+#endif
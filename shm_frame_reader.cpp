@@ -0,0 +1,120 @@
+// shm_frame_reader.cpp
+// Reference reader for the shared-memory frame sink (shm_frame_sink.h).
+// COMPILE: g++ -O2 shm_frame_reader.cpp -o shm_frame_reader
+//
+// Attaches to /dev/shm/<name> written by `park_2d --shm=<name>` or
+// `railway_3d --shm=<name>`, polls for new frames, reads each one in place
+// and reports the latency from publish until the reader saw the frame, plus
+// frames missed (more than one frame was published between two polls) and
+// torn reads (a slot was rewritten while being read).
+
+#include "shm_frame_sink.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <sys/stat.h>
+
+// Accepts "--name value" and "--name=value"; returns nullptr if argv[i] is
+// not that option.
+const char* optionValue(int argc, char** argv, int& i, const char* name) {
+    size_t len = strlen(name);
+    if (strncmp(argv[i], name, len) != 0) return nullptr;
+    if (argv[i][len] == '=') return argv[i] + len + 1;
+    if (argv[i][len] == '\0' && i + 1 < argc) return argv[++i];
+    return nullptr;
+}
+
+void sleepNs(long ns) {
+    timespec ts = { 0, ns };
+    nanosleep(&ts, nullptr);
+}
+
+// Maps /dev/shm/<name> read-only once the renderer has finished creating it.
+ShmFrameHeader* attach(const char* name, size_t& size) {
+    std::string path = std::string("/") + name;
+    int fd = shm_open(path.c_str(), O_RDONLY, 0);
+    if (fd < 0) return nullptr;
+    struct stat st;
+    void* mapping = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= 4096) {
+        size = (size_t)st.st_size;
+        mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (mapping == MAP_FAILED) return nullptr;
+    ShmFrameHeader* header = (ShmFrameHeader*)mapping;
+    bool ready = memcmp(header->magic, SHM_FRAME_MAGIC, sizeof(SHM_FRAME_MAGIC)) == 0;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (!ready || header->version != SHM_FRAME_VERSION) {
+        munmap(mapping, size);
+        return nullptr;
+    }
+    return header;
+}
+
+double percentile(std::vector<double>& v, double p) {
+    if (v.empty()) return 0;
+    size_t i = std::min(v.size() - 1, (size_t)(p * v.size()));
+    std::nth_element(v.begin(), v.begin() + i, v.end());
+    return v[i];
+}
+
+int main(int argc, char** argv) {
+    const char* name = "park";
+    long frames = -1;
+    long pollNs = 50000;
+    for (int i = 1; i < argc; i++) {
+        const char* v;
+        if ((v = optionValue(argc, argv, i, "--frames"))) frames = atol(v);
+        else if ((v = optionValue(argc, argv, i, "--poll-us"))) pollNs = atol(v) * 1000;
+        else if (argv[i][0] != '-') name = argv[i];
+    }
+
+    size_t size = 0;
+    ShmFrameHeader* header;
+    fprintf(stderr, "waiting for /dev/shm/%s\n", name);
+    while (!(header = attach(name, size))) sleepNs(10000000);
+    fprintf(stderr, "attached: %ux%u, %u slots\n", header->width, header->height, header->slotCount);
+
+    std::vector<double> latencyUs;
+    long read = 0, missed = 0, torn = 0;
+    uint64_t next = header->published.load(std::memory_order_acquire);
+    uint64_t checksum = 0;
+    while (frames < 0 || read < frames) {
+        uint64_t published = header->published.load(std::memory_order_acquire);
+        if (published == next) {
+            if (header->closed.load(std::memory_order_acquire)) break;
+            if (pollNs > 0) sleepNs(pollNs);
+            continue;
+        }
+        int64_t seenNs = monotonicNs();
+        // only the newest frame is of interest; older ones may already be overwritten
+        uint64_t frame = published - 1;
+        missed += (long)(frame - next);
+        next = published;
+        ShmSlotHeader* slot = shmSlot(header, frame);
+        uint64_t before = slot->sequence.load(std::memory_order_acquire);
+        if (before != 2 * frame + 2) { torn++; continue; }
+        int64_t publishNs = slot->publishNs;
+        // consume the frame in place, as a compositor would
+        const uint32_t* pixels = shmSlotPixels(slot);
+        uint64_t sum = 0;
+        for (size_t i = 0, n = (size_t)header->width * header->height; i < n; i++) sum += pixels[i];
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot->sequence.load(std::memory_order_relaxed) != before) { torn++; continue; }
+        checksum += sum;
+        latencyUs.push_back((seenNs - publishNs) / 1000.0);
+        read++;
+    }
+
+    fprintf(stderr, "%ld frames read, %ld missed, %ld torn\n", read, missed, torn);
+    if (!latencyUs.empty()) {
+        double p50 = percentile(latencyUs, 0.5), p99 = percentile(latencyUs, 0.99);
+        fprintf(stderr, "publish-to-read latency: p50 %.1f us, p99 %.1f us, max %.1f us\n",
+                p50, p99, *std::max_element(latencyUs.begin(), latencyUs.end()));
+    }
+    printf("%llx\n", (unsigned long long)checksum);
+    munmap(header, size);
+    return 0;
+}
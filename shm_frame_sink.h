@@ -0,0 +1,138 @@
+// shm_frame_sink.h
+// Live frame sink in shared memory, shared by the 2D park, the 3D station and
+// the shm_frame_reader tool.
+//
+// The renderer publishes every completed frame into a ring of slots in a
+// memory-mapped file under /dev/shm. Each slot is guarded by a sequence
+// number (a seqlock): it is odd while the renderer writes the slot and even
+// once the frame is complete. A reader maps the same file, reads a slot's
+// pixels in place and checks the sequence number again afterwards; if it
+// changed, the renderer came round the ring and the read is retried or
+// skipped. Readers never block the renderer and never copy a frame.
+#ifndef SHM_FRAME_SINK_H
+#define SHM_FRAME_SINK_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+const char SHM_FRAME_MAGIC[8] = { 'F', 'R', 'A', 'M', 'E', 'S', 'H', 'M' };
+const uint32_t SHM_FRAME_VERSION = 1;
+
+// At offset 0 of the mapping.
+struct ShmFrameHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t width, height;           // RGBA8 pixels, bottom row first
+    uint32_t slotCount;
+    uint64_t slotsOffset;             // byte offset of slot 0
+    uint64_t slotStride;              // bytes from one slot to the next
+    std::atomic<uint64_t> published;  // frames published so far; the newest is published - 1
+    std::atomic<uint32_t> closed;     // set when the renderer exits or resizes and unlinks the file
+};
+
+// At the start of each slot, followed by the pixels at offset 64.
+struct alignas(64) ShmSlotHeader {
+    std::atomic<uint64_t> sequence;   // 2 * frame + 1 while writing, 2 * frame + 2 when complete
+    int64_t publishNs;                // CLOCK_MONOTONIC time the frame was completed
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared-memory atomics must be lock-free");
+static_assert(sizeof(ShmSlotHeader) == 64, "pixels start 64 bytes into a slot");
+
+inline int64_t monotonicNs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+inline ShmSlotHeader* shmSlot(ShmFrameHeader* header, uint64_t frame) {
+    return (ShmSlotHeader*)((char*)header + header->slotsOffset + (frame % header->slotCount) * header->slotStride);
+}
+
+inline uint32_t* shmSlotPixels(ShmSlotHeader* slot) { return (uint32_t*)(slot + 1); }
+
+class ShmFrameSink {
+public:
+    ~ShmFrameSink() { close(); }
+
+    // Creates /dev/shm/<name> for frames of width x height.
+    bool open(const char* shmName, int width, int height, int slots = 3) {
+        close();
+        name = std::string("/") + shmName;
+        size_t pixelBytes = (size_t)width * height * 4;
+        uint64_t stride = (sizeof(ShmSlotHeader) + pixelBytes + 4095) & ~(uint64_t)4095;
+        size = 4096 + stride * slots;
+        shm_unlink(name.c_str());
+        int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0644);
+        if (fd < 0) return false;
+        bool ok = ftruncate(fd, (off_t)size) == 0;
+        void* mapping = ok ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+        ::close(fd);
+        if (mapping == MAP_FAILED) {
+            shm_unlink(name.c_str());
+            return false;
+        }
+        header = new (mapping) ShmFrameHeader();
+        header->version = SHM_FRAME_VERSION;
+        header->width = width;
+        header->height = height;
+        header->slotCount = slots;
+        header->slotsOffset = 4096;
+        header->slotStride = stride;
+        for (int i = 0; i < slots; i++) new (shmSlot(header, i)) ShmSlotHeader();
+        // readers check the magic last, so they never see a half-built header
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(header->magic, SHM_FRAME_MAGIC, sizeof(SHM_FRAME_MAGIC));
+        return true;
+    }
+
+    bool isOpen() const { return header != nullptr; }
+    int width() const { return header ? (int)header->width : 0; }
+    int height() const { return header ? (int)header->height : 0; }
+
+    // Returns the pixels of the next slot for the renderer to fill; readers
+    // of that slot see it as being written until endFrame().
+    uint32_t* beginFrame() {
+        uint64_t frame = header->published.load(std::memory_order_relaxed);
+        ShmSlotHeader* slot = shmSlot(header, frame);
+        slot->sequence.store(2 * frame + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        return shmSlotPixels(slot);
+    }
+
+    void endFrame() {
+        uint64_t frame = header->published.load(std::memory_order_relaxed);
+        ShmSlotHeader* slot = shmSlot(header, frame);
+        slot->publishNs = monotonicNs();
+        slot->sequence.store(2 * frame + 2, std::memory_order_release);
+        header->published.store(frame + 1, std::memory_order_release);
+    }
+
+    void publish(const uint32_t* pixels) {
+        memcpy(beginFrame(), pixels, (size_t)header->width * header->height * 4);
+        endFrame();
+    }
+
+    // Marks the ring closed for attached readers and removes the file.
+    void close() {
+        if (!header) return;
+        header->closed.store(1, std::memory_order_release);
+        munmap(header, size);
+        shm_unlink(name.c_str());
+        header = nullptr;
+    }
+
+private:
+    std::string name;
+    ShmFrameHeader* header = nullptr;
+    size_t size = 0;
+};
+
+#endif
@@ -0,0 +1,142 @@
+// trace_events.h
+// Scoped timing events written in the Chrome trace-event format, shared by
+// the 2D park, the 3D station and the frame writer. Load the JSON in
+// chrome://tracing or https://ui.perfetto.dev.
+//
+//     void drawGround() {
+//         TRACE_FUNCTION();           // or TRACE_SCOPE("name")
+//         ...
+//     }
+//
+// Each thread appends events to its own buffer, so recording takes no lock;
+// the buffers are written out by writeTraceJson() once the threads are
+// idle. While tracing is off (the default) a scope costs one branch on
+// traceEnabled, which is always false and so always predicted.
+#ifndef TRACE_EVENTS_H
+#define TRACE_EVENTS_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct TraceEvent {
+    const char* name;     // must outlive the trace: a literal or __func__
+    char phase;           // 'X' complete event, 'C' counter
+    int64_t startNs;
+    int64_t value;        // duration in ns for 'X', the counter value for 'C'
+};
+
+struct TraceThread {
+    int tid;
+    std::string name;
+    std::vector<TraceEvent> events;
+    uint64_t dropped = 0;
+};
+
+const size_t TRACE_EVENTS_PER_THREAD = 1 << 20;   // 32 MB per thread, then events are dropped
+
+inline bool traceEnabled = false;
+inline int64_t traceEpochNs = 0;
+inline std::mutex traceRegistryMutex;
+inline std::vector<std::unique_ptr<TraceThread>> traceThreads;
+
+inline int64_t traceNowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline void traceEnable() {
+    traceEpochNs = traceNowNs();
+    traceEnabled = true;
+}
+
+// The calling thread's buffer, registered on first use. Buffers are owned
+// by traceThreads and outlive their threads.
+inline TraceThread& traceThread() {
+    thread_local TraceThread* current = nullptr;
+    if (!current) {
+        std::lock_guard<std::mutex> lock(traceRegistryMutex);
+        traceThreads.emplace_back(new TraceThread());
+        current = traceThreads.back().get();
+        current->tid = (int)traceThreads.size();
+        current->events.reserve(4096);
+    }
+    return *current;
+}
+
+inline void traceRecord(const char* name, char phase, int64_t startNs, int64_t value) {
+    TraceThread& t = traceThread();
+    if (t.events.size() < TRACE_EVENTS_PER_THREAD) t.events.push_back({ name, phase, startNs, value });
+    else t.dropped++;
+}
+
+// Names the calling thread in the trace viewer.
+inline void traceThreadName(const char* name) {
+    if (traceEnabled) traceThread().name = name;
+}
+
+inline void traceCounter(const char* name, int64_t value) {
+    if (__builtin_expect(traceEnabled, 0)) traceRecord(name, 'C', traceNowNs(), value);
+}
+
+class TraceScope {
+public:
+    explicit TraceScope(const char* scopeName) {
+        if (__builtin_expect(traceEnabled, 0)) {
+            name = scopeName;
+            start = traceNowNs();
+        }
+    }
+    ~TraceScope() {
+        if (name) traceRecord(name, 'X', start, traceNowNs() - start);
+    }
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    const char* name = nullptr;
+    int64_t start = 0;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope, __LINE__)(name)
+#define TRACE_FUNCTION() TRACE_SCOPE(__func__)
+
+// Writes every thread's events as a trace-event JSON file. The threads that
+// recorded them must not be recording any more (joined, or idle after
+// handing their last results to the caller).
+inline bool writeTraceJson(const char* path) {
+    FILE* f = fopen(path, "w");
+    if (!f) return false;
+    std::lock_guard<std::mutex> lock(traceRegistryMutex);
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    bool first = true;
+    uint64_t dropped = 0;
+    for (const auto& t : traceThreads) {
+        dropped += t->dropped;
+        if (!t->name.empty()) {
+            fprintf(f, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+                    first ? "" : ",\n", t->tid, t->name.c_str());
+            first = false;
+        }
+        for (const TraceEvent& e : t->events) {
+            double ts = (e.startNs - traceEpochNs) / 1000.0;
+            if (e.phase == 'X')
+                fprintf(f, "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+                        first ? "" : ",\n", e.name, t->tid, ts, e.value / 1000.0);
+            else
+                fprintf(f, "%s{\"name\": \"%s\", \"ph\": \"C\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"args\": {\"value\": %lld}}",
+                        first ? "" : ",\n", e.name, t->tid, ts, (long long)e.value);
+            first = false;
+        }
+    }
+    fprintf(f, "\n]}\n");
+    if (dropped) fprintf(stderr, "trace: %llu events dropped (buffers full)\n", (unsigned long long)dropped);
+    return fclose(f) == 0;
+}
+
+#endif